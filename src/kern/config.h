@@ -30,6 +30,54 @@
 #define USER_END_VMA    0xD0000000UL // End of user program space
 #define USER_STACK_VMA  USER_END_VMA // starting user stack pointer
 
+// File mappings created by the mmap system call are placed in this part of
+// the user window, well clear of the program image and the stack.
+
+#define USER_MMAP_VMA     0xC8000000UL // Start of mmap area
+#define USER_MMAP_END_VMA 0xCC000000UL // End of mmap area
+
+// Kernel virtual area in which kvmalloc maps allocations larger than a page.
+// It lies in the gigarange after the user window.
+
+#define KVM_START_VMA 0x100000000UL // Start of kvmalloc area
+#define KVM_END_VMA   0x104000000UL // End of kvmalloc area
+
+// RAM at and above RAM_HIGH_PMA would overlap the user window if it were
+// identity-mapped, so the kernel maps it at RAM_HIGH_VMA instead, in the
+// gigaranges above the kvmalloc area. RAM may extend up to RAM_MAX_END_PMA,
+// i.e., be up to 4 GB.
+
+#define RAM_HIGH_PMA    0xC0000000UL  // Start of RAM not identity-mapped
+#define RAM_HIGH_VMA    0x1C0000000UL // Kernel address of RAM_HIGH_PMA
+#define RAM_MAX_END_PMA 0x180000000UL // End of largest supported RAM
+
+// Number of pages mapped by a single user page fault (fault-around), by kind
+// of page. The stack window extends down from the faulting page, the others
+// extend up. A value of 1 maps only the faulting page.
+
+#define FAULT_AROUND_STACK 16 // anonymous pages above the mmap area
+#define FAULT_AROUND_HEAP  16 // other anonymous pages
+#define FAULT_AROUND_FILE  16 // pages of demand-paged regions (ELF, mmap)
+
+// Interval at which the working-set sampler (wss.c) scans the accessed and
+// dirty bits of user mappings
+
+#define WSS_SAMPLE_MS 100
+
+// Maximum number of harts the kernel runs on. Any others are parked at boot.
+// The value in start.s has to match.
+
+#ifndef NHART
+#define NHART 4
+#endif
+
+// Scheduling class of new threads: fifo (round-robin in the order threads
+// become ready) or mlfq (multi-level feedback queue). See thread.c.
+
+#ifndef SCHED_DEFAULT
+#define SCHED_DEFAULT mlfq
+#endif
+
 #define UART0_IOBASE 0x10000000 // PMA
 #define UART1_IOBASE 0x10000100 // PMA
 #define UART0_IRQNO 10
@@ -6,6 +6,7 @@
 #include "halt.h"
 #include "string.h"
 #include "error.h"
+#include "sync.h"
 
 //           COMPILE-TIME PARAMETER DEFAULTS
 //          
@@ -33,10 +34,16 @@ struct device {
 
 struct device devtab[NDEV];
 
+//           devtab only changes when a driver attaches, but is searched on every
+//           open, so readers go through a seqlock.
+
+static struct seqlock devtab_seqlock;
+
 //           EXPORTED FUNCTION DEFINITIONS
 //          
 
 void devmgr_init(void) {
+    seqlock_init(&devtab_seqlock, "devtab");
     devmgr_initialized = 1;
 }
 
@@ -45,12 +52,15 @@ int device_register (
     int (*openfn)(struct io_intf ** ioptr, void * aux),
     void * aux)
 {    
+    int saved_intr_state;
     int devno = 0;
     int instno = 0;
 
     assert (name != NULL);
     assert (openfn != NULL);
 
+    saved_intr_state = seqlock_write_begin(&devtab_seqlock);
+
 	//           Find empty slot in devtab
 
 	while (devno < NDEV) {
@@ -70,6 +80,8 @@ int device_register (
 	devtab[devno].openfn = openfn;
 	devtab[devno].aux = aux;
 
+    seqlock_write_end(&devtab_seqlock, saved_intr_state);
+
     debug("%s%d registered (openfn=%p,aux=%p)", name, instno, openfn, aux);
 
 	return instno;
@@ -80,25 +92,37 @@ int device_open (
     const char * name,
     int instno)
 {
-	int devno = 0;
-	int k = 0;
+	struct device dev;
+	uint32_t seq;
+	int devno;
+	int k;
 
 	trace("%s(name=%s,instno=%d)", __func__, name, instno);
 
-	//           Find instno-th instance of device in devtab
-
-	while (devno < NDEV) {
-		if (devtab[devno].openfn != NULL &&
-			strcmp(devtab[devno].name, name) == 0)
-		{
-			if (k == instno)
-				break;
-			else
-				k += 1;
+	//           Find instno-th instance of device in devtab. A slot being filled
+	//           in may be seen half written, hence the check of both fields.
+
+	do {
+		seq = seqlock_read_begin(&devtab_seqlock);
+		devno = 0;
+		k = 0;
+
+		while (devno < NDEV) {
+			if (devtab[devno].openfn != NULL && devtab[devno].name != NULL &&
+				strcmp(devtab[devno].name, name) == 0)
+			{
+				if (k == instno)
+					break;
+				else
+					k += 1;
+			}
+
+			devno += 1;
 		}
 
-		devno += 1;
-	}
+		if (devno < NDEV)
+			dev = devtab[devno];
+	} while (seqlock_read_retry(&devtab_seqlock, seq));
 
 	if (devno == NDEV) {
 		debug("Device %s%d not found", name, instno);
@@ -108,5 +132,5 @@ int device_open (
 
 	//           Call driver's open function
 
-	return devtab[devno].openfn(ioptr, devtab[devno].aux);
+	return dev.openfn(ioptr, dev.aux);
 }
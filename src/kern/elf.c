@@ -7,11 +7,16 @@
 #include "string.h"
 #include "config.h"
 #include "memory.h"
+#include "process.h"
 
 #define EI_NIDENT 16
 
 #define PT_LOAD    1  /* program header type */
 
+#define PF_X       (1 << 0)  /* segment permission flags */
+#define PF_W       (1 << 1)
+#define PF_R       (1 << 2)
+
 #define ET_EXEC   2   /* executable type */
 #define EM_RISCV	243	/* RISC-V */
 
@@ -54,7 +59,9 @@ typedef struct elf64_phdr {
 
 
 //elf_load
-//loads an elf file into user memory to be ran as a program.
+//loads an elf file into user memory to be ran as a program. Segments are not
+//read here; they are recorded as demand-paged regions of the current process
+//and their pages are read from io when first accessed.
 //inputs: io - pointer to the io interface to read the .elf from
 //        entryptr - double pointer to write the entry point of the program to
 //returns: status of elf_load - 0 represents success
@@ -122,12 +129,17 @@ int elf_load(struct io_intf *io, void (**entryptr)(void)){
         return -EINVAL;
       }
 
-      // Move io object to point to the data to copy
-      ioseek(io, phdr.p_offset);
-      // Read data from io object into memory at mem pointer
-      memory_alloc_and_map_range(phdr.p_vaddr, phdr.p_memsz, (PTE_R | PTE_W | PTE_X | PTE_U));
-      ioread(io, (void *)phdr.p_vaddr, phdr.p_filesz);
-      memset((void *)phdr.p_vaddr + phdr.p_filesz, 0, phdr.p_memsz - phdr.p_filesz);
+      uint_fast8_t flags = PTE_U;
+      if(phdr.p_flags & PF_R) flags |= PTE_R;
+      if(phdr.p_flags & PF_W) flags |= PTE_W | PTE_R;
+      if(phdr.p_flags & PF_X) flags |= PTE_X;
+
+      // Pages past p_filesz are zero-filled on first touch (BSS)
+      int result = memory_region_add(current_process()->regions,
+        phdr.p_vaddr, phdr.p_memsz, flags, io, phdr.p_offset, phdr.p_filesz);
+      if(result < 0){
+        return result;
+      }
     }
 
     return 0;
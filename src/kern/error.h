@@ -14,5 +14,6 @@
 #define EACCESS     8
 #define EBADFD      9
 #define EMFILE     10
+#define ENOMEM     11
 
 #endif // _ERROR_H_
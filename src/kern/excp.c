@@ -6,6 +6,7 @@
 #include "halt.h"
 #include "memory.h"
 #include "timer.h"
+#include "config.h"
 
 #include <stddef.h>
 
@@ -51,14 +52,37 @@ static const char * const excp_names[] = {
 //
 
 void smode_excp_handler(unsigned int code, struct trap_frame * tfr) {
-	default_excp_handler(code, tfr);
+    const uintptr_t vma = csrr_stval();
+
+    switch (code) {
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+    case RISCV_SCAUSE_STORE_PAGE_FAULT:
+        // The kernel accesses user buffers directly (e.g. for read and
+        // write). Their pages may not be paged in yet or may still be shared
+        // copy-on-write with another process.
+        if (USER_START_VMA <= vma && vma < USER_END_VMA) {
+            memory_handle_page_fault((void *)vma,
+                (code == RISCV_SCAUSE_STORE_PAGE_FAULT) ? PTE_W : PTE_R);
+            break;
+        }
+        // fall through
+    default:
+        default_excp_handler(code, tfr);
+        break;
+    }
 }
 
 void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
     switch (code) {
     // TODO: FIXME dispatch to various U mode exception handlers
+    case RISCV_SCAUSE_INSTR_PAGE_FAULT:
+        memory_handle_page_fault((void *)csrr_stval(), PTE_X);
+        break;
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+        memory_handle_page_fault((void *)csrr_stval(), PTE_R);
+        break;
     case RISCV_SCAUSE_STORE_PAGE_FAULT:
-        memory_handle_page_fault((void *)csrr_stval());
+        memory_handle_page_fault((void *)csrr_stval(), PTE_W);
         break;
     case RISCV_SCAUSE_ECALL_FROM_UMODE:
         syscall_handler(tfr);
@@ -1,4 +1,4 @@
-// ezheap.c - Leaking memory manager for small allocations
+// ezheap.c - Slab allocator for small allocations
 //
 
 #ifndef TRACE
@@ -19,9 +19,49 @@
 #include "string.h"
 #include "halt.h"
 #include "memory.h"
+#include "config.h"
 
 #include <stdint.h>
 
+// COMPILE-TIME PARAMETERS
+//
+
+// Size classes are the powers of two from HEAP_MIN_SIZE to HEAP_MAX_SIZE.
+// Larger requests get a block of whole pages from the page allocator.
+
+#define HEAP_MIN_ORDER 4
+#define HEAP_MAX_ORDER 10
+#define HEAP_MIN_SIZE (1UL << HEAP_MIN_ORDER)
+#define HEAP_MAX_SIZE (1UL << HEAP_MAX_ORDER)
+#define HEAP_NCLASS (HEAP_MAX_ORDER - HEAP_MIN_ORDER + 1)
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+union free_obj {
+    union free_obj * next;
+    char data[HEAP_MIN_SIZE];
+};
+
+// A slab is a page holding objects of one size class, with this header at
+// the start of the page. Freed objects go on the slab's free list. Objects
+// past /unused/ have never been handed out, so a new slab does not need its
+// free list built up front. A slab is on its class's partial list while it
+// has an object to give out.
+
+struct slab {
+    struct slab * next;
+    struct slab * prev;
+    union free_obj * free;
+    char * unused;
+    uint16_t inuse; // objects handed out
+    uint8_t cls; // size class index
+    uint8_t boot; // page is part of the initial heap block
+};
+
+#define SLAB_HDR_SIZE \
+    ((sizeof(struct slab) + HEAP_MIN_SIZE-1) / HEAP_MIN_SIZE * HEAP_MIN_SIZE)
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -30,55 +70,93 @@ char heap_initialized = 0;
 // INTERNAL GLOBAL VARIABLES
 //
 
-static void * heap_start;
-static void * heap_end;
+// partial[k] lists the slabs of objects of size HEAP_MIN_SIZE << k that have
+// at least one object free.
+
+static struct slab * partial[HEAP_NCLASS];
+
+// Whole pages of the initial heap block given to heap_init. They are not
+// owned by the page allocator, so empty slabs made from them come back here.
+
+static struct slab * boot_pages;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline unsigned int size_class(size_t size);
+static inline size_t class_size(unsigned int cls);
+static inline struct slab * obj_slab(const void * ptr);
+static inline int slab_full(const struct slab * slab);
+static struct slab * slab_create(unsigned int cls);
+static void slab_destroy(struct slab * slab);
+static void partial_push(struct slab * slab);
+static void partial_remove(struct slab * slab);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
 
 void heap_init(void * start, void * end) {
+    void * pp;
+
     trace("%s(%p,%p)", __func__, start, end);
     assert (start < end);
-    heap_start = start;
-    heap_end = end;
+
+    // Only the whole pages of the initial block can hold slabs
+
+    pp = (void *)(((uintptr_t)start + PAGE_SIZE-1) & ~(PAGE_SIZE-1));
+
+    while (pp + PAGE_SIZE <= end) {
+        ((struct slab *)pp)->next = boot_pages;
+        boot_pages = pp;
+        pp += PAGE_SIZE;
+    }
+
     heap_initialized = 1;
 }
 
+// Objects up to HEAP_MAX_SIZE come from a slab of their size class; popping
+// an object off the first partial slab takes constant time. Larger requests
+// get a block of 2^k pages, which is page aligned, unlike any slab object.
+
 void * kmalloc(size_t size) {
-    void * new_block;
+    union free_obj * obj;
+    struct slab * slab;
+    unsigned int order;
+    unsigned int cls;
 
     trace("%s(%zu)", __func__, size);
 
-    // Round up to multiple of 16 bytes
-    size = (size + 16-1) / 16 * 16;
+    if (HEAP_MAX_SIZE < size) {
+        order = 0;
+        while ((PAGE_SIZE << order) < size)
+            order += 1;
+        return memory_alloc_pages(order);
+    }
 
-    if (PAGE_SIZE < size)
-        panic("heap alloc request too large");
-    
-    // If the request fits in the current heap block, allocate from it.
+    cls = size_class(size);
+    slab = partial[cls];
 
-    if (size <= heap_end - heap_start) {
-        heap_end -= size;
-        return heap_end;
+    if (slab == NULL) {
+        slab = slab_create(cls);
+        partial_push(slab);
     }
 
-    // The request is no more than a page, but we don't have room for it in the
-    // current block of heap memory. Get a direct-mapped page of physical memory
-    // from the memory manager.
+    if (slab->free != NULL) {
+        obj = slab->free;
+        slab->free = obj->next;
+    } else {
+        obj = (union free_obj *)slab->unused;
+        slab->unused += class_size(cls);
+    }
 
-    new_block = memory_alloc_page();
+    slab->inuse += 1;
 
-    // Do we have more free space left if we abandon the current block and
-    // switch to the new one, or just use the new block for this request and
-    // stay with the current block?
+    // Take a slab that ran out of objects off the partial list
 
-    if (heap_end - heap_start < PAGE_SIZE - size) {
-        // switch to new block
-        heap_start = new_block;
-        heap_end = new_block + PAGE_SIZE - size;
-        return heap_end;
-    } else
-        return new_block;
+    if (slab_full(slab))
+        partial_remove(slab);
+
+    return obj;
 }
 
 void * kcalloc(size_t n, size_t size) {
@@ -94,11 +172,232 @@ void * kcalloc(size_t n, size_t size) {
     return ptr;
 }
 
+// Grows or shrinks an allocation, moving it if it no longer fits in its size
+// class or block. krealloc(NULL, size) is kmalloc(size), and krealloc(ptr, 0)
+// frees ptr and returns NULL.
+
 void * krealloc(void * ptr, size_t size) {
-    panic("krealloc not implemented");
+    size_t old_size;
+    void * new_ptr;
+
+    trace("%s(%p,%zu)", __func__, ptr, size);
+
+    if (ptr == NULL)
+        return kmalloc(size);
+
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    if (((uintptr_t)ptr & (PAGE_SIZE-1)) == 0)
+        old_size = PAGE_SIZE << memory_block_order(ptr);
+    else
+        old_size = class_size(obj_slab(ptr)->cls);
+
+    // Keep the allocation if the new size rounds up to the same class or block
+
+    if (old_size <= HEAP_MAX_SIZE) {
+        if (size <= HEAP_MAX_SIZE && size_class(size) == size_class(old_size))
+            return ptr;
+    } else if (HEAP_MAX_SIZE < size && size <= old_size && old_size < 2 * size)
+        return ptr;
+
+    new_ptr = kmalloc(size);
+    memcpy(new_ptr, ptr, (size < old_size) ? size : old_size);
+    kfree(ptr);
+    return new_ptr;
 }
 
+// Returns an object to its slab in constant time. A slab that gets its first
+// free object goes back on the partial list, and one with no objects left in
+// use is given back to the page allocator.
+
 void kfree(void * ptr) {
+    union free_obj * const obj = ptr;
+    struct slab * slab;
+
     trace("%s(%p)", __func__, ptr);
-    // do nothing
+
+    if (ptr == NULL)
+        return;
+
+    if (((uintptr_t)ptr & (PAGE_SIZE-1)) == 0) {
+        memory_free_pages(ptr, memory_block_order(ptr));
+        return;
+    }
+
+    slab = obj_slab(ptr);
+    assert (slab->inuse != 0);
+
+    if (slab_full(slab))
+        partial_push(slab);
+
+    obj->next = slab->free;
+    slab->free = obj;
+    slab->inuse -= 1;
+
+    if (slab->inuse == 0) {
+        partial_remove(slab);
+        slab_destroy(slab);
+    }
+}
+
+// Requests larger than a page are mapped in the kernel virtual area rather
+// than taken from a physically contiguous block, which may not be available.
+
+void * kvmalloc(size_t size) {
+    void * ptr;
+
+    trace("%s(%zu)", __func__, size);
+
+    if (size <= PAGE_SIZE)
+        return kmalloc(size);
+
+    ptr = memory_kvm_alloc(size);
+
+    if (ptr == NULL)
+        panic("kvmalloc area exhausted");
+
+    return ptr;
+}
+
+void kvfree(void * ptr) {
+    trace("%s(%p)", __func__, ptr);
+
+    if (KVM_START_VMA <= (uintptr_t)ptr && (uintptr_t)ptr < KVM_END_VMA)
+        memory_kvm_free(ptr);
+    else
+        kfree(ptr);
+}
+
+void kmem_cache_init(struct kmem_cache * cache, const char * name,
+    size_t size, void (*ctor)(void * obj), void (*dtor)(void * obj))
+{
+    trace("%s(%s,%zu)", __func__, name, size);
+    assert (sizeof(void *) <= size);
+
+    cache->name = name;
+    cache->size = size;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->free = NULL;
+    cache->free_cnt = 0;
+}
+
+void * kmem_cache_alloc(struct kmem_cache * cache) {
+    void * obj;
+
+    trace("%s(%s)", __func__, cache->name);
+
+    if (cache->free != NULL) {
+        obj = cache->free;
+        cache->free = *(void **)obj;
+        cache->free_cnt -= 1;
+        return obj;
+    }
+
+    obj = kmalloc(cache->size);
+
+    if (cache->ctor != NULL)
+        cache->ctor(obj);
+    
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache * cache, void * obj) {
+    trace("%s(%s,%p)", __func__, cache->name, obj);
+
+    if (KMEM_CACHE_MAX <= cache->free_cnt) {
+        if (cache->dtor != NULL)
+            cache->dtor(obj);
+        kfree(obj);
+        return;
+    }
+
+    *(void **)obj = cache->free;
+    cache->free = obj;
+    cache->free_cnt += 1;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static inline unsigned int size_class(size_t size) {
+    unsigned int cls = 0;
+
+    while (class_size(cls) < size)
+        cls += 1;
+
+    return cls;
+}
+
+static inline size_t class_size(unsigned int cls) {
+    return HEAP_MIN_SIZE << cls;
+}
+
+static inline struct slab * obj_slab(const void * ptr) {
+    return (struct slab *)((uintptr_t)ptr & ~(PAGE_SIZE-1));
+}
+
+// Returns 1 if /slab/ has no object left to give out.
+
+static inline int slab_full(const struct slab * slab) {
+    return slab->free == NULL &&
+        (char *)slab + PAGE_SIZE - slab->unused < class_size(slab->cls);
+}
+
+// Makes an empty slab for size class /cls/ out of a page of the initial heap
+// block if there is one left, or else a page from the page allocator.
+
+static struct slab * slab_create(unsigned int cls) {
+    struct slab * slab;
+
+    if (boot_pages != NULL) {
+        slab = boot_pages;
+        boot_pages = slab->next;
+        slab->boot = 1;
+    } else {
+        slab = memory_alloc_page_unzeroed();
+        slab->boot = 0;
+    }
+
+    debug("new slab %p for %zu-byte objects", slab, class_size(cls));
+
+    slab->next = slab->prev = NULL;
+    slab->free = NULL;
+    slab->unused = (char *)slab + SLAB_HDR_SIZE;
+    slab->inuse = 0;
+    slab->cls = cls;
+    return slab;
+}
+
+static void slab_destroy(struct slab * slab) {
+    debug("freeing slab %p", slab);
+
+    if (slab->boot) {
+        slab->next = boot_pages;
+        boot_pages = slab;
+    } else
+        memory_free_page(slab);
+}
+
+static void partial_push(struct slab * slab) {
+    slab->prev = NULL;
+    slab->next = partial[slab->cls];
+    if (slab->next != NULL)
+        slab->next->prev = slab;
+    partial[slab->cls] = slab;
+}
+
+static void partial_remove(struct slab * slab) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        partial[slab->cls] = slab->next;
+
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+
+    slab->next = slab->prev = NULL;
 }
@@ -6,6 +6,27 @@
 
 #include <stddef.h>
 
+//           An object cache keeps up to KMEM_CACHE_MAX freed objects of one type
+//           in their constructed state, so that allocating one is a pop off a
+//           list. The constructor /ctor/ runs when the cache has to allocate a
+//           new object and the destructor /dtor/ (which may be NULL) when it
+//           frees one because it already holds KMEM_CACHE_MAX. Objects must be
+//           given back in the state the constructor leaves them in, except for
+//           their first word, which links the cached objects together.
+
+#ifndef KMEM_CACHE_MAX
+#define KMEM_CACHE_MAX 8
+#endif
+
+struct kmem_cache {
+    const char * name;
+    size_t size;
+    void (*ctor)(void * obj);
+    void (*dtor)(void * obj);
+    void * free; // cached objects
+    size_t free_cnt;
+};
+
 //           Initializes the heap memory manager (for small objects).
 
 extern void heap_init(void * start, void * end);
@@ -16,5 +37,19 @@ extern void * kcalloc(size_t n, size_t size);
 extern void * krealloc(void * ptr, size_t size);
 extern void kfree(void * ptr);
 
+//           kvmalloc allocates memory that is contiguous in the kernel's virtual
+//           address space but not necessarily in physical memory, so it cannot
+//           be handed to a device for DMA. Requests of up to a page are served
+//           by kmalloc, larger ones page by page from the kernel virtual area.
+//           kvfree frees memory returned by either kvmalloc or kmalloc.
+
+extern void * kvmalloc(size_t size);
+extern void kvfree(void * ptr);
+
+extern void kmem_cache_init(struct kmem_cache * cache, const char * name,
+    size_t size, void (*ctor)(void * obj), void (*dtor)(void * obj));
+extern void * kmem_cache_alloc(struct kmem_cache * cache);
+extern void kmem_cache_free(struct kmem_cache * cache, void * obj);
+
 //           _HEAP_H_
 #endif
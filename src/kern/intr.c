@@ -15,6 +15,7 @@
 #include "csr.h"
 #include "plic.h"
 #include "timer.h"
+#include "thread.h"
 
 #include <stddef.h>
 
@@ -54,11 +55,21 @@ void intr_init(void) {
     plic_init();
 
     csrw_sip(0); // clear all pending interrupts
-    csrw_sie(RISCV_SIE_SEIE); //enable interrupts from plic
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE); // plic and IPIs (smp.c)
 
     intr_initialized = 1;
 }
 
+void intr_init_hart(void) {
+    trace("%s()", __func__);
+
+    intr_disable();
+    plic_init_hart(running_hart());
+
+    csrw_sip(0);
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE);
+}
+
 void intr_register_isr (
     int irqno, int prio,
     void (*isr)(int irqno, void * aux),
@@ -88,10 +99,14 @@ void intr_disable_irq(int irqno) {
 
 // void intr_handler(int code, struct trap_frame * tfr)
 // Called from trapasm.s to handle an interrupt. Dispataches to
-// timer_intr_handler and extern_intr_handler.
+// timer_intr_handler and extern_intr_handler. An IPI needs no handling beyond
+// clearing it: it only wakes the hart from wfi or brings it into the kernel.
 
 void intr_handler(int code, struct trap_frame * tfr) {
     switch (code) {
+    case RISCV_SCAUSE_INTR_EXCODE_SSI:
+        csrc_sip(RISCV_SIP_SSIP);
+        break;
     case RISCV_SCAUSE_INTR_EXCODE_SEI:
         extern_intr_handler();
         break;
@@ -23,6 +23,12 @@ extern char intr_initialized;
 
 extern void intr_init(void);
 
+// void intr_init_hart(void)
+// Sets up interrupts on a hart other than hart 0, after intr_init has run on
+// hart 0. Interrupts are left disabled.
+
+extern void intr_init_hart(void);
+
 static inline int intr_enable(void);
 static inline int intr_disable(void);
 static inline void intr_restore(int saved);
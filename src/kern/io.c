@@ -4,6 +4,7 @@
 #include "io.h"
 #include "string.h"
 #include "error.h"
+#include "heap.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -201,6 +202,75 @@ struct io_intf * iolit_init (struct io_lit * lit, void * buf, size_t size) {
     return &lit->io_intf;
 }
 
+/**
+ * Name: iobuf_close
+ * 
+ * Inputs:
+ *  struct io_intf *    -> io
+ * 
+ * Outputs:
+ *  None
+ * 
+ * Purpose:
+ *  Frees an I/O buffer once its last reference is closed.
+ * 
+ * Side effects:
+ *  The buffer and its contents are returned to the kernel heap.
+ */
+static void iobuf_close(struct io_intf *io) {
+    kfree((char *)io - offsetof(struct io_buf, lit.io_intf));
+}
+
+/**
+ * Name: iobuf_alloc
+ * 
+ * Inputs:
+ *  size_t              -> size
+ * 
+ * Outputs:
+ *  struct io_buf *     -> ib
+ * 
+ * Purpose:
+ *  Allocates an I/O buffer with room for size bytes of contents, which the caller fills in
+ *  before calling iobuf_init.
+ * 
+ * Side effects:
+ *  Allocates memory from the kernel heap.
+ */
+struct io_buf * iobuf_alloc(size_t size) {
+    return kmalloc(sizeof(struct io_buf) + size);
+}
+
+/**
+ * Name: iobuf_init
+ * 
+ * Inputs:
+ *  struct io_buf *     -> ib
+ *  size_t              -> len
+ * 
+ * Outputs:
+ *  struct io_intf *    -> io
+ * 
+ * Purpose:
+ *  Makes the first len bytes of an I/O buffer readable through the io_intf interface, like an
+ *  I/O literal that cannot be written. Closing the interface frees the buffer.
+ * 
+ * Side effects:
+ *  None.
+ */
+struct io_intf * iobuf_init(struct io_buf * ib, size_t len) {
+    static const struct io_ops ops = {
+        .close = iobuf_close,
+        .read = iolit_read,
+        .ctl = iolit_ioctl
+    };
+
+    iolit_init(&ib->lit, ib->buf, len);
+    ib->lit.io_intf.ops = &ops;
+
+    return &ib->lit.io_intf;
+}
+
     //            I/O term provides three features:
     //           
     //                1. Input CRLF normalization. Any of the following character sequences in
@@ -9,6 +9,7 @@
 #include <stdarg.h> // va_list
 
 #include "error.h"  // ENOTSUP
+#include "sync.h"   // refcount_get
 
 // EXPORTED TYPE DEFINITIONS
 //
@@ -49,6 +50,11 @@ struct io_term {
     int8_t cr_in;
 };
 
+struct io_buf {
+    struct io_lit lit;
+    char buf[];
+};
+
 // IOCTL numbers (0..7 are reserved)
 
 #define IOCTL_GETLEN        1   // arg is pointer to uint64_t
@@ -164,6 +170,18 @@ extern struct io_intf *
 __attribute__ ((nonnull(1,2)))
 iolit_init(struct io_lit * lit, void * buf, size_t size);
 
+// An I/O buffer is a read-only I/O literal allocated on the kernel heap
+// together with its memory, which is freed when the I/O object is closed.
+// Devices use it to hand out a snapshot of a text report. iobuf_alloc returns
+// an io_buf with room for /size/ bytes in its /buf/ member. Once the caller
+// has filled in the buffer, iobuf_init makes its first /len/ bytes readable.
+
+extern struct io_buf * iobuf_alloc(size_t size);
+
+extern struct io_intf *
+__attribute__ ((nonnull(1)))
+iobuf_init(struct io_buf * ib, size_t len);
+
 // An io_term object is a wrapper around a "raw" I/O object. It provides newline
 // conversion and interactive line-editing for string input.
 //
@@ -187,13 +205,11 @@ ioterm_getsn(struct io_term * iot, char * buf, size_t n);
 //
 
 static inline uint32_t ioref(struct io_intf * io) {
-    io->refcnt += 1;
-    return io->refcnt;
+    return refcount_get(&io->refcnt);
 }
 
 static inline void ioclose(struct io_intf * io) {
-    io->refcnt--;
-    if (io->ops->close != NULL && io->refcnt == 0)
+    if (refcount_put(&io->refcnt) && io->ops->close != NULL)
         io->ops->close(io);
 }
 
@@ -19,6 +19,8 @@
 struct lock {
     struct condition cond;
     int tid; // thread holding lock or -1
+    struct thread * owner; // thread holding lock or NULL (see thread.c)
+    struct lock * next; // next lock held by the same thread
 };
 
 static inline void lock_init(struct lock * lk, const char * name);
@@ -32,6 +34,8 @@ static inline void lock_init(struct lock * lk, const char * name) {
     trace("%s(<%s:%p>", __func__, name, lk);
     condition_init(&lk->cond, name);
     lk->tid = -1;
+    lk->owner = NULL;
+    lk->next = NULL;
 }
 
 /**
@@ -45,18 +49,23 @@ static inline void lock_init(struct lock * lk, const char * name) {
  *
  * Purpose:
  *  Acquires sleep lock by waiting until it becomes available. The lock is tied to the thread
- *  that successfully acquires it.
+ *  that successfully acquires it. While the calling thread waits, the owner of the lock runs
+ *  with the caller's priority if it is higher than its own, so that a low-priority owner
+ *  cannot hold up a high-priority waiter.
  *
  * Side effects:
- *  Suspends the calling thread if lock in use. If lock available, update lock's state. 
+ *  Suspends the calling thread if lock in use, boosting the owner (and, if the owner is
+ *  waiting for another lock, that lock's owner, and so on). If lock available, update lock's
+ *  state and add it to the locks held by the calling thread.
  */
 static inline void lock_acquire(struct lock * lk) {
-    // TODO CP3: FIXME implement this
-    // then use in vioblk and kfs drivers
+    trace("%s(<%s:%p>", __func__, lk->cond.name, lk);
+
     while(lk->tid >= 0){
-        condition_wait(&lk->cond);
+        thread_lock_wait(lk);
     }
     lk->tid = running_thread();
+    thread_lock_acquired(lk);
 }
 
 static inline void lock_release(struct lock * lk) {
@@ -64,7 +73,10 @@ static inline void lock_release(struct lock * lk) {
 
     assert (lk->tid == running_thread());
     
+    // Give up any priority inherited from the waiters, then wake them
+
     lk->tid = -1;
+    thread_lock_released(lk);
     condition_broadcast(&lk->cond);
     debug("Thread <%s:%d> released lock <%s:%p>",
         thread_name(running_thread()), running_thread(),
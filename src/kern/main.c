@@ -26,11 +26,15 @@
 #include "string.h"
 #include "process.h"
 #include "config.h"
+#include "wss.h"
+#include "meminfo.h"
+#include "smp.h"
 
 
 void main(void) {
     struct io_intf * initio;
     struct io_intf * blkio;
+    struct io_intf * swapio;
     void * mmio_base;
     int result;
     int i;
@@ -42,7 +46,7 @@ void main(void) {
     thread_init();
     procmgr_init();
     timer_init();
-
+    smp_init();
 
     // Attach NS16550a serial devices
 
@@ -62,6 +66,9 @@ void main(void) {
 
     intr_enable();
 
+    wss_init();
+    meminfo_init();
+
     result = device_open(&blkio, "blk", 0);
 
     if (result != 0)
@@ -75,6 +82,11 @@ void main(void) {
     if (result != 0)
         panic("fs_mount failed");
 
+    // A second block device, if there is one, is used for swap
+
+    if (device_open(&swapio, "blk", 1) == 0)
+        memory_swap_init(swapio);
+
     result = fs_open(INIT_PROC, &initio);
 
     if (result < 0)
@@ -0,0 +1,323 @@
+// main_alloc_tests.c - Main function: tests for the page and slab allocators
+//
+// Link this instead of main.o. Runs on one hart with the timer off, so that
+// nothing else allocates memory while a test looks at where blocks come from.
+// Halts with success if every check passes.
+
+#include "console.h"
+#include "thread.h"
+#include "device.h"
+#include "intr.h"
+#include "memory.h"
+#include "heap.h"
+#include "halt.h"
+#include "string.h"
+#include "config.h"
+
+#include <stdint.h>
+
+#define BLOCK_ORDER 3 // order of the block split up by the coalescing tests
+#define NPIECE (1 << BLOCK_ORDER)
+#define MAX_EXTRA (1 << PAGE_MAX_ORDER) // allocations that miss the block
+
+#define SLAB_MIN_SIZE 16 // smallest kmalloc size class (see ezheap.c)
+#define SLAB_MAX_SIZE 1024 // largest; larger requests get whole pages
+#define NSLABOBJ (3 * PAGE_SIZE / 512) // objects of the slab release test
+
+// Orders in which the coalescing tests free the pages of a block
+
+enum free_order {
+    FREE_FORWARD,
+    FREE_REVERSE,
+    FREE_INTERLEAVED // even pages first, so no buddies meet until the odd ones
+};
+
+static void * pieces[NPIECE];
+static void * extras[MAX_EXTRA];
+static size_t extra_cnt;
+
+static int test_block_alignment(void);
+static int test_coalesce(enum free_order order);
+static int split_block(void * blk);
+static int reassemble_block(void * blk);
+static void free_extras(void);
+static int test_slab_classes(void);
+static int test_slab_large(void);
+static int test_slab_release(void);
+static size_t free_pages(void);
+static int check(const char * name, uint64_t val, uint64_t expected);
+
+void main(void) {
+    int failed = 0;
+
+    console_init();
+    memory_init();
+    intr_init();
+    devmgr_init();
+    thread_init();
+
+    failed += test_block_alignment();
+    failed += test_coalesce(FREE_FORWARD);
+    failed += test_coalesce(FREE_REVERSE);
+    failed += test_coalesce(FREE_INTERLEAVED);
+    failed += test_slab_classes();
+    failed += test_slab_large();
+    failed += test_slab_release();
+
+    if (failed == 0) {
+        console_printf("All allocator tests passed\n");
+        halt_success();
+    } else {
+        console_printf("%d allocator tests failed\n", failed);
+        halt_failure();
+    }
+}
+
+// A block of 2^k pages is aligned to its size relative to the start of RAM
+// and remembers its order.
+
+int test_block_alignment(void) {
+    const size_t free_before = free_pages();
+    void * blks[BLOCK_ORDER + 3];
+    uintptr_t misaligned = 0;
+    uintptr_t wrong_order = 0;
+    unsigned int k;
+
+    for (k = 0; k < BLOCK_ORDER + 3; k++) {
+        blks[k] = memory_alloc_pages(k);
+        if ((kva_to_pma(blks[k]) - RAM_START_PMA) % (PAGE_SIZE << k) != 0)
+            misaligned += 1;
+        if (memory_block_order(blks[k]) != k)
+            wrong_order += 1;
+    }
+
+    while (k-- > 0)
+        memory_free_pages(blks[k], k);
+
+    return check("buddy alignment", misaligned, 0) +
+        check("buddy block order", wrong_order, 0) +
+        check("buddy alloc/free balance", free_pages(), free_before);
+}
+
+// Splits a block into single pages, frees them in the given order and checks
+// that they merge back into the block.
+
+int test_coalesce(enum free_order order) {
+    static const char * const names[] = {
+        [FREE_FORWARD] = "buddy coalesce (forward)",
+        [FREE_REVERSE] = "buddy coalesce (reverse)",
+        [FREE_INTERLEAVED] = "buddy coalesce (interleaved)"
+    };
+
+    const size_t free_before = free_pages();
+    void * const blk = memory_alloc_pages(BLOCK_ORDER);
+    int found;
+    int i;
+
+    memory_free_pages(blk, BLOCK_ORDER);
+
+    if (!split_block(blk)) {
+        free_extras();
+        return check(names[order], 0, 1);
+    }
+
+    switch (order) {
+    case FREE_FORWARD:
+        for (i = 0; i < NPIECE; i++)
+            memory_free_page(pieces[i]);
+        break;
+    case FREE_REVERSE:
+        for (i = NPIECE - 1; i >= 0; i--)
+            memory_free_page(pieces[i]);
+        break;
+    case FREE_INTERLEAVED:
+        for (i = 0; i < NPIECE; i += 2)
+            memory_free_page(pieces[i]);
+        for (i = 1; i < NPIECE; i += 2)
+            memory_free_page(pieces[i]);
+        break;
+    }
+
+    free_extras();
+
+    // The block can only be handed out whole again if its pages merged
+
+    found = reassemble_block(blk);
+    free_extras();
+
+    if (found)
+        memory_free_pages(blk, BLOCK_ORDER);
+
+    return check(names[order], found, 1) +
+        check("buddy free page count", free_pages(), free_before);
+}
+
+// Allocates single pages until every page of the free block /blk/ is in
+// pieces[], ordered by address. Pages from elsewhere go to extras[]. Returns 0
+// if the block's pages did not all turn up.
+
+int split_block(void * blk) {
+    int found = 0;
+    void * pp;
+    int i;
+
+    while (found < NPIECE && extra_cnt < MAX_EXTRA && 0 < free_pages()) {
+        pp = memory_alloc_page_unzeroed();
+        i = (pp - blk) / (long)PAGE_SIZE;
+
+        if (blk <= pp && i < NPIECE) {
+            pieces[i] = pp;
+            found += 1;
+        } else
+            extras[extra_cnt++] = pp;
+    }
+
+    return (found == NPIECE);
+}
+
+// Allocates blocks of the size of /blk/ until /blk/ itself is handed out, and
+// returns 1 if it is. The other blocks go to extras[].
+
+int reassemble_block(void * blk) {
+    void * pp;
+
+    while (extra_cnt < MAX_EXTRA && NPIECE < free_pages()) {
+        pp = memory_alloc_pages(BLOCK_ORDER);
+        if (pp == blk)
+            return 1;
+        extras[extra_cnt++] = pp;
+    }
+
+    return 0;
+}
+
+void free_extras(void) {
+    while (extra_cnt > 0) {
+        extra_cnt -= 1;
+        memory_free_pages(extras[extra_cnt],
+            memory_block_order(extras[extra_cnt]));
+    }
+}
+
+// Each size class from SLAB_MIN_SIZE to SLAB_MAX_SIZE holds every request
+// larger than half its size, and a freed object is the next one handed out.
+
+int test_slab_classes(void) {
+    uintptr_t misplaced = 0;
+    uintptr_t wrong_class = 0;
+    uintptr_t not_reused = 0;
+    size_t size, low;
+    void * a, * b, * c;
+
+    for (size = SLAB_MIN_SIZE; size <= SLAB_MAX_SIZE; size *= 2) {
+        low = (size == SLAB_MIN_SIZE) ? 1 : size / 2 + 1;
+
+        // /b/ or another object keeps the slab of /a/ alive while it is free
+
+        a = kmalloc(size);
+        b = kmalloc(low);
+
+        if (((uintptr_t)a & (PAGE_SIZE-1)) == 0 ||
+            ((uintptr_t)b & (PAGE_SIZE-1)) == 0)
+        {
+            misplaced += 1;
+        }
+
+        kfree(a);
+        c = kmalloc(size);
+        if (c != a)
+            not_reused += 1;
+
+        // Resizing within the class keeps the object; one more byte moves it
+
+        if (krealloc(b, size) != b)
+            wrong_class += 1;
+
+        a = krealloc(b, size + 1);
+        if (a == b)
+            wrong_class += 1;
+
+        kfree(a);
+        kfree(c);
+    }
+
+    return check("slab objects inside slabs", misplaced, 0) +
+        check("slab size class bounds", wrong_class, 0) +
+        check("slab object reuse", not_reused, 0);
+}
+
+// Requests above SLAB_MAX_SIZE get a block of whole pages, which krealloc
+// keeps while the new size still fits and is more than half of it.
+
+int test_slab_large(void) {
+    const size_t free_before = free_pages();
+    uintptr_t failed = 0;
+    char * p, * q;
+
+    p = kmalloc(SLAB_MAX_SIZE + 1);
+    if (((uintptr_t)p & (PAGE_SIZE-1)) != 0 || memory_block_order(p) != 0)
+        failed += 1;
+
+    q = kmalloc(PAGE_SIZE + 1);
+    if (((uintptr_t)q & (PAGE_SIZE-1)) != 0 || memory_block_order(q) != 1)
+        failed += 1;
+
+    if (krealloc(p, PAGE_SIZE * 3 / 4) != p)
+        failed += 1;
+
+    kfree(q);
+    kfree(p);
+
+    // Growing a slab object past SLAB_MAX_SIZE moves it to a page
+
+    p = kmalloc(SLAB_MAX_SIZE);
+    memset(p, 0x5a, SLAB_MAX_SIZE);
+    q = krealloc(p, SLAB_MAX_SIZE + 1);
+
+    if (((uintptr_t)q & (PAGE_SIZE-1)) != 0 ||
+        q[0] != 0x5a || q[SLAB_MAX_SIZE-1] != 0x5a)
+    {
+        failed += 1;
+    }
+
+    kfree(q);
+
+    return check("kmalloc large blocks", failed, 0) +
+        check("kmalloc large alloc/free balance", free_pages(), free_before);
+}
+
+// Slabs that empty out give their pages back, whatever order their objects
+// are freed in.
+
+int test_slab_release(void) {
+    const size_t free_before = free_pages();
+    static void * objs[NSLABOBJ];
+    int i;
+
+    for (i = 0; i < NSLABOBJ; i++)
+        objs[i] = kmalloc(512);
+
+    for (i = 0; i < NSLABOBJ; i += 2)
+        kfree(objs[i]);
+    for (i = NSLABOBJ - 1; i > 0; i -= 2)
+        kfree(objs[i]);
+
+    return check("slab pages released", free_pages(), free_before);
+}
+
+size_t free_pages(void) {
+    struct memory_stats st;
+
+    memory_get_stats(&st);
+    return st.free;
+}
+
+int check(const char * name, uint64_t val, uint64_t expected) {
+    if (val == expected) {
+        console_printf("%s: ok\n", name);
+        return 0;
+    } else {
+        console_printf("%s: FAILED (%lu, expected %lu)\n", name, val, expected);
+        return 1;
+    }
+}
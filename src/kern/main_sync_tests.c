@@ -0,0 +1,167 @@
+// main_sync_tests.c - Main function: stress tests for sync.h under -smp
+//
+// Link this instead of main.o and run with several harts (see QEMUOPTS). The
+// worker threads spread over the harts and hammer the primitives at the same
+// time. Halts with success if every check passes.
+
+#include "console.h"
+#include "thread.h"
+#include "device.h"
+#include "timer.h"
+#include "intr.h"
+#include "memory.h"
+#include "process.h"
+#include "halt.h"
+#include "smp.h"
+#include "sync.h"
+#include "config.h"
+
+#include <stdint.h>
+
+#define NWORKER (2*NHART)
+#define NITER 100000
+
+// Data hammered by the workers
+
+static uint32_t atomic_cnt;
+static uint32_t cmpxchg_cnt;
+static uint32_t locked_cnt; // only modified while holding cnt_lock
+static struct spinlock cnt_lock;
+
+static struct seqlock pair_seqlock;
+static uint64_t pair_a; // pair_b is always ~pair_a
+static uint64_t pair_b;
+static uint32_t torn_reads;
+
+static uint32_t refcnt = 1;
+static uint32_t early_puts; // times refcount_put returned 1 in a worker
+
+static uint32_t hart_workers[NHART]; // workers that ran on each hart
+
+static void worker(void * arg);
+static int check(const char * name, uint64_t val, uint64_t expected);
+
+void main(void) {
+    int tids[NWORKER];
+    struct alarm al;
+    int failed = 0;
+    int hartid;
+    int i;
+
+    console_init();
+    memory_init();
+    intr_init();
+    devmgr_init();
+    thread_init();
+    procmgr_init();
+    timer_init();
+    smp_init();
+
+    intr_enable();
+
+    spinlock_init(&cnt_lock, "cnt");
+    seqlock_init(&pair_seqlock, "pair");
+    pair_b = ~pair_a;
+
+    // The other harts come online once we let go of the kernel lock
+
+    alarm_init(&al, "harts");
+    alarm_sleep_ms(&al, 100);
+
+    console_printf("%d harts online, %d workers, %d iterations each\n",
+        smp_hart_cnt, NWORKER, NITER);
+
+    for (i = 0; i < NWORKER; i++)
+        tids[i] = thread_spawn("worker", worker, (void*)(uintptr_t)i);
+
+    for (i = 0; i < NWORKER; i++)
+        thread_join(tids[i]);
+
+    for (hartid = 0; hartid < NHART; hartid++) {
+        if (hart_workers[hartid] != 0)
+            console_printf("hart %d ran %u workers\n",
+                hartid, hart_workers[hartid]);
+    }
+
+    failed += check("atomic_add", atomic_cnt, NWORKER * NITER);
+    failed += check("atomic_cmpxchg", cmpxchg_cnt, NWORKER * NITER);
+    failed += check("spinlock", locked_cnt, NWORKER * NITER);
+    failed += check("seqlock writes", pair_a, NITER);
+    failed += check("seqlock torn reads", torn_reads, 0);
+    failed += check("refcount", refcnt, 1);
+    failed += check("refcount early puts", early_puts, 0);
+    failed += check("refcount last put", refcount_put(&refcnt), 1);
+
+    if (failed == 0) {
+        console_printf("All sync tests passed\n");
+        halt_success();
+    } else {
+        console_printf("%d sync tests failed\n", failed);
+        halt_failure();
+    }
+}
+
+// Worker 0 writes the seqlock-protected pair; the others read it.
+
+void worker(void * arg) {
+    const int id = (uintptr_t)arg;
+    int saved_intr_state;
+    uint64_t a, b;
+    uint32_t seq;
+    uint32_t old;
+    int i;
+
+    atomic_add(&hart_workers[running_hart()], 1);
+
+    // Let go of the kernel lock, or the workers would take turns rather than
+    // run at the same time. Nothing below touches kernel state. Interrupts
+    // stay disabled, as no ISR may run without the kernel lock.
+
+    intr_disable();
+    kernel_unlock();
+
+    for (i = 0; i < NITER; i++) {
+        atomic_add(&atomic_cnt, 1);
+
+        do
+            old = atomic_read(&cmpxchg_cnt);
+        while (atomic_cmpxchg(&cmpxchg_cnt, old, old + 1) != old);
+
+        saved_intr_state = spinlock_acquire(&cnt_lock);
+        locked_cnt += 1;
+        spinlock_release(&cnt_lock, saved_intr_state);
+
+        refcount_get(&refcnt);
+        if (refcount_put(&refcnt))
+            atomic_add(&early_puts, 1);
+
+        if (id == 0) {
+            saved_intr_state = seqlock_write_begin(&pair_seqlock);
+            pair_a += 1;
+            pair_b = ~pair_a;
+            seqlock_write_end(&pair_seqlock, saved_intr_state);
+        } else {
+            do {
+                seq = seqlock_read_begin(&pair_seqlock);
+                a = pair_a;
+                b = pair_b;
+            } while (seqlock_read_retry(&pair_seqlock, seq));
+
+            if (b != ~a)
+                atomic_add(&torn_reads, 1);
+        }
+    }
+
+    kernel_lock();
+    intr_enable();
+}
+
+int check(const char * name, uint64_t val, uint64_t expected) {
+    if (val == expected) {
+        console_printf("%s: ok\n", name);
+        return 0;
+    } else {
+        console_printf("%s: FAILED (%lu, expected %lu)\n", name, val, expected);
+        return 1;
+    }
+}
@@ -0,0 +1,86 @@
+// meminfo.c - Memory usage report
+//
+
+#ifdef MEMINFO_TRACE
+#define TRACE
+#endif
+
+#ifdef MEMINFO_DEBUG
+#define DEBUG
+#endif
+
+#include "meminfo.h"
+#include "memory.h"
+#include "process.h"
+#include "device.h"
+#include "string.h"
+#include "console.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Size of the text buffer a report is formatted into when the device is opened
+
+#define MEMINFO_REPORT_MAX (64 * (NPROC + 12))
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int meminfo_open(struct io_intf ** ioptr, void * aux);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void meminfo_init(void) {
+    trace("%s()", __func__);
+
+    if (device_register("meminfo", meminfo_open, NULL) < 0)
+        kprintf("meminfo: device_register failed\n");
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Opening the device takes a snapshot of the counters as a text report
+
+static int meminfo_open(struct io_intf ** ioptr, void * aux) {
+    const struct process * proc;
+    struct memory_stats st;
+    struct io_buf * rpt;
+    size_t len;
+    int pid;
+
+    memory_get_stats(&st);
+    rpt = iobuf_alloc(MEMINFO_REPORT_MAX);
+
+    len = snprintf(rpt->buf, MEMINFO_REPORT_MAX,
+        "MemTotal: %zu\n"
+        "MemFree: %zu\n"
+        "MemZeroed: %zu\n"
+        "MemPeak: %zu\n"
+        "PageTables: %zu\n"
+        "SwapTotal: %zu\n"
+        "SwapUsed: %zu\n"
+        "MinorFaults: %zu\n"
+        "MajorFaults: %zu\n"
+        "pid rss minflt majflt (pages)\n",
+        st.total, st.free, st.zeroed, st.peak, st.ptab,
+        st.swap_total, st.swap_used, st.minflt, st.majflt);
+
+    for (pid = 0; pid < NPROC; pid++) {
+        proc = proctab[pid];
+
+        if (proc == NULL)
+            continue;
+
+        len += snprintf(rpt->buf + len, MEMINFO_REPORT_MAX - len,
+            "%d %zu %zu %zu\n", proc->id, proc->rss, proc->minflt,
+            proc->majflt);
+    }
+
+    if (MEMINFO_REPORT_MAX <= len)
+        len = MEMINFO_REPORT_MAX - 1;
+
+    *ioptr = iobuf_init(rpt, len);
+    return 0;
+}
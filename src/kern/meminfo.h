@@ -0,0 +1,20 @@
+// meminfo.h - Memory usage report
+//
+
+#ifndef _MEMINFO_H_
+#define _MEMINFO_H_
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void meminfo_init(void)
+// Registers the "meminfo" device. Reading it returns a text report of the
+// counters kept by the memory manager: total, free, zeroed and peak used
+// physical pages, page table pages and swap slots in use, and the number of
+// minor and major page faults, followed by one line per process with its
+// resident set size and fault counts. Must be called after the device manager
+// is initialized.
+
+extern void meminfo_init(void);
+
+#endif // _MEMINFO_H_
@@ -24,6 +24,9 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "io.h"
+#include "lock.h"
+#include "smp.h"
 
 #include <stdint.h>
 
@@ -32,6 +35,7 @@
 
 char memory_initialized = 0;
 uintptr_t main_mtag;
+uintptr_t asid0_mtag[NHART];
 
 // IMPORTED VARIABLE DECLARATIONS
 //
@@ -51,7 +55,10 @@ extern char _kimg_end[];
 //
 
 union linked_page {
-    union linked_page * next;
+    struct {
+        union linked_page * next;
+        union linked_page * prev;
+    };
     char padding[PAGE_SIZE];
 };
 
@@ -64,6 +71,29 @@ struct pte {
     uint64_t n:1;
 };
 
+// Per-frame metadata, one entry for each physical page of RAM. The reference
+// count of a page mapped into user space is the number of leaf PTEs that point
+// to it; the page is returned to the free list when the last one goes away.
+// A user page mapped by exactly one PTE also records where that PTE is, so
+// that the page can be swapped out. The owner is stored as the parts of its
+// mtag (see frame_owner_mtag) to keep the entry at 12 bytes. When the page is
+// shared, the owner is kept while it still maps the page, and gets the page
+// back once the other sharers are gone.
+
+struct frame {
+    uint16_t refcnt;
+    uint8_t order; // order of the block headed by this frame
+    uint8_t flags; // FRAME_* flags below
+    uint16_t upn; // page index of the mapping in the user window (FRAME_USER)
+    uint16_t asid; // ASID of the memory space of the mapping (FRAME_USER)
+    uint32_t root; // page number of its root page table (FRAME_USER)
+};
+
+#define FRAME_FREE (1 << 0) // head of a block on a free list
+#define FRAME_USER (1 << 1) // private user page, upn, asid and root are valid
+#define FRAME_REF (1 << 2) // accessed bit taken by memory_space_sample
+#define FRAME_OWNED (1 << 3) // shared page still mapped by its owner
+
 // INTERNAL MACRO DEFINITIONS
 //
 
@@ -72,12 +102,35 @@ struct pte {
 #define VPN0(vma) (((vma) >> 12) & 0x1FF)
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
+// Number of pages asked back from the balloon driver at a time when physical
+// memory runs out.
+
+#define BALLOON_DEFLATE_CNT 64
+
+// Ranges of up to this many pages are flushed from the TLB one page at a
+// time; larger ones flush the whole ASID.
+
+#define SFENCE_RANGE_MAX 16
+
+// A megapage is backed by one buddy block of this order.
+
+#define MEGA_ORDER 9
+
+// Software-defined PTE bits (pte.rsw). A COW page is mapped read-only and is
+// copied on the first store to it if it is still shared.
+
+#define PTE_RSW_COW (1 << 0)
+
+// A swapped-out page has a PTE with V clear, PTE_RSW_SWAP set and the swap slot
+// holding its contents in the ppn field. The other flags are kept for when the
+// page is swapped back in.
+
+#define PTE_RSW_SWAP (1 << 1)
+
 // Internal constants defintions    
 //
 
 #define PGSIZE 4096 // Page size (4 kB)
-#define USER_BASE 0xC0000000 // Start of user space?
-#define USER_TOP 0xD0000000 // End of user space?
 
 // INTERNAL FUNCTION DECLARATIONS
 //
@@ -109,15 +162,150 @@ static inline struct pte ptab_pte (
 static inline struct pte null_pte(void);
 
 static inline void sfence_vma(void);
+static inline void sfence_vma_asid(uint_fast16_t asid);
+static void sfence_vma_range(uintptr_t vma, size_t size);
+static inline uint_fast16_t active_space_asid(void);
+static void memory_asid_free(uint_fast16_t asid);
 static inline int verify_flags(uint64_t flags);
 static inline struct pte * walk_pt(struct pte* root, uintptr_t vma, int create);
-static inline int unmap_user_page(uintptr_t flags);
+static struct pte * walk_pt0(struct pte * root, uintptr_t vma, int create);
+static struct pte * walk_pt1(struct pte * root, uintptr_t vma, int create);
+static struct pte * find_leaf(struct pte * root, uintptr_t vma, size_t * szptr);
+static inline int pte_is_leaf(const struct pte * pte);
+static void set_leaf_flags(struct pte * pte, uint_fast8_t rwxug_flags);
+static int map_megapage(struct pte * root, uintptr_t vma, uint_fast8_t rwxug_flags);
+static struct pte * split_megapage(struct pte * pt1e, uintptr_t vma);
+static void promote_megapage(struct pte * root, uintptr_t vma);
+static void map_page(struct pte * root, uintptr_t vma, void * pp, uint_fast8_t rwxug_flags);
+static struct mem_region * find_region(uintptr_t vma);
+static void set_user_leaf(struct pte * pte, uintptr_t vma, void * pp, uint_fast8_t rwxug_flags);
+static void * region_fill_page (
+    struct mem_region * rgn, uintptr_t vma, uint_fast8_t access, int may_swap);
+static int region_map_page(uintptr_t vma, uint_fast8_t access);
+static void map_anon_page(uintptr_t vma, uint_fast8_t access);
+static void fault_around(uintptr_t vma, uint_fast8_t access);
+static void * try_alloc_page(void);
+static int free_user_pt0(struct pte * pt0, int lo, int hi);
+static int free_user_pt1(struct pte * pt1, int lo, int hi, uintptr_t base);
+static inline int pt_empty(const struct pte * pt);
+static void * alloc_ptab(void);
+static void free_ptab(void * pt);
+static void rss_add(uintptr_t mtag, long cnt);
 void memory_set_page_flags(const void *vp, uint8_t rwxug_flags);
 
+static inline struct frame * pageptr_to_frame(const void * pp);
+static inline uintptr_t pageptr_to_framenum(const void * pp);
+static inline void * framenum_to_pageptr(uintptr_t n);
+static void free_list_push(union linked_page * blk, unsigned int order);
+static union linked_page * alloc_block(unsigned int order);
+static union linked_page * bump_alloc(unsigned int order);
+static inline uintptr_t frame_owner_mtag(const struct frame * fr);
+static inline void track_free_low(void);
+static void * zeroed_pool_pop(void);
+static void zeroed_pool_drain(void);
+static inline void zero_page(void * pp);
+static void free_list_remove(union linked_page * blk, unsigned int order);
+static inline void page_ref(void * pp);
+static inline void page_unref(void * pp);
+static void cow_break(struct pte * pte, uintptr_t vma);
+static void mega_cow_break(struct pte * pte, uintptr_t vma);
+
+static inline void frame_set_owner(void * pp, uintptr_t vma);
+static void sample_leaf(struct pte * pte, size_t cnt, struct memory_sample * smp);
+static void frame_claim(const struct pte * pte, uintptr_t vma, uintptr_t mtag);
+static inline int pte_swapped(const struct pte * pte);
+static int swap_slot_alloc(void);
+static void swap_slot_unref(uintptr_t slot);
+static int swap_out_page(void);
+static int reclaim_page(void);
+static int swap_in_page(uintptr_t vma);
+static int fault_in(uintptr_t vma, uint_fast8_t access);
+static void * user_page_ptr(uintptr_t vma, uint_fast8_t rwxug_flags);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
-static union linked_page * free_list;
+// Buddy allocator state. free_lists[k] holds free blocks of 2^k pages. Blocks
+// are aligned to their size relative to RAM_START, so the buddy of the block
+// starting at frame n is the block starting at frame n ^ (1 << k). No block
+// straddles RAM_HIGH_PMA, so each one is contiguous in the direct map too.
+
+static union linked_page * free_lists[PAGE_MAX_ORDER+1];
+static size_t free_cnt; // pages on the free lists
+
+// Pool of single pages that are known to contain all zeroes, refilled by the
+// idle thread (see memory_prezero_page). Pages in the pool are not on any of
+// the free lists above, whose contents are dirty.
+
+static union linked_page * zeroed_pool;
+static size_t zeroed_cnt;
+
+// Page of zeroes shared by all memory spaces. Reads of anonymous and BSS pages
+// that were never written map it read-only (and copy-on-write if the page is
+// writable), so they cost neither a page nor zeroing. It is not reference
+// counted and is never freed or swapped out.
+
+static void * shared_zero_page;
+
+// Frame table, placed in RAM right after the heap by memory_init. Frames at
+// and above bump_fn have never been handed out: they are not on the free
+// lists, and their frametab entries are not initialized until bump_alloc
+// carves them off. This keeps boot time independent of RAM_SIZE.
+
+#define NFRAME (RAM_SIZE / PAGE_SIZE)
+
+static struct frame * frametab;
+static uintptr_t bump_fn;
+
+// ASID allocator. Bit n of asid_map is set if ASID n is in use. ASID 0 belongs
+// to the main memory space and is also handed out when the others run out, so
+// it is never in the map. asid_cnt is the number of ASIDs the hart supports,
+// capped at NASID.
+
+static uint64_t asid_map[(NASID + 63) / 64];
+static uint_fast16_t asid_cnt;
+
+// Serializes page-ins from backing files. Filling a page moves the file
+// position, which has to be restored before anyone else uses the file.
+
+static struct lock pager_lock;
+
+// Swap space. swap_refcnt[n] is the number of swapped-out PTEs that refer to
+// slot n of swap_io. swap_lock is held while a page is written out or read
+// back, so a fault on a page that is still being written waits for the write.
+// clock_hand is the next frame the page-out clock looks at.
+
+static struct io_intf * swap_io;
+static uint8_t * swap_refcnt;
+static size_t swap_nslot;
+static struct lock swap_lock;
+static uintptr_t clock_hand;
+
+// Set by the balloon driver. Returns up to /cnt/ pages taken by the balloon
+// to the free lists and returns how many it gave back.
+
+static size_t (*balloon_deflate)(size_t cnt);
+
+// Counters reported by memory_get_stats. page_total is the number of pages
+// the page allocator started out with and free_low the fewest of them that
+// have been free at once. ptab_cnt counts the page tables allocated with
+// alloc_ptab and swap_used the swap slots with a non-zero reference count.
+
+static size_t page_total;
+static size_t free_low;
+static size_t ptab_cnt;
+static size_t swap_used;
+static size_t minflt_cnt;
+static size_t majflt_cnt;
+
+// Kernel virtual area. Bit n of kvm_map is set if page n of the area is mapped
+// or is the unmapped guard page that ends an allocation. The area's level-1
+// table is reached through a global root entry that every memory space copies
+// from the main one, so mappings made later are seen by all of them.
+
+#define KVM_NPAGE ((KVM_END_VMA - KVM_START_VMA) / PAGE_SIZE)
+
+static uint64_t kvm_map[KVM_NPAGE / 64];
 
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
@@ -125,6 +313,10 @@ static struct pte main_pt1_0x80000[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
 static struct pte main_pt0_0x80000[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
+static struct pte main_pt1_ram_tail[PTE_CNT]
+    __attribute__ ((section(".bss.pagetable"), aligned(4096)));
+static struct pte main_pt1_kvm[PTE_CNT]
+    __attribute__ ((section(".bss.pagetable"), aligned(4096)));
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -145,6 +337,12 @@ void memory_init(void) {
 
     assert (RAM_START == _kimg_start);
 
+    // RAM past RAM_HIGH_PMA is mapped at RAM_HIGH_VMA, where there is room
+    // for up to RAM_MAX_END_PMA.
+
+    if (RAM_MAX_END_PMA < RAM_END_PMA)
+        panic("RAM_SIZE too large");
+
     kprintf("           RAM: [%p,%p): %zu MB\n",
         RAM_START, RAM_END, RAM_SIZE / 1024 / 1024);
     kprintf("  Kernel image: [%p,%p)\n", _kimg_start, _kimg_end);
@@ -161,6 +359,10 @@ void memory_init(void) {
     // _kimg_end to RAM_START+MEGA_SIZE: RW pages (heap and free page pool)
     // RAM_START+MEGA_SIZE to RAM_END:   RW megapages (free page pool)
     //
+    // RAM from RAM_HIGH_PMA on is not identity-mapped but mapped at
+    // RAM_HIGH_VMA, in RW gigapages and, for a partial last gigarange, RW
+    // megapages. pma_to_kva and kva_to_pma convert between the two.
+    //
     // RAM_START = 0x80000000
     // MEGA_SIZE = 2 MB
     // GIGA_SIZE = 1 GB
@@ -193,13 +395,40 @@ void memory_init(void) {
             leaf_pte(pp, PTE_R | PTE_W | PTE_G);
     }
 
-    // Remaining RAM mapped in 2MB megapages
+    // Rest of the third gigarange mapped in 2MB megapages
 
-    for (pp = RAM_START + MEGA_SIZE; pp < RAM_END; pp += MEGA_SIZE) {
-        main_pt1_0x80000[VPN1((uintptr_t)pp)] =
-            leaf_pte(pp, PTE_R | PTE_W | PTE_G);
+    for (pma = RAM_START_PMA + MEGA_SIZE;
+         pma < RAM_END_PMA && pma < RAM_HIGH_PMA;
+         pma += MEGA_SIZE)
+    {
+        main_pt1_0x80000[VPN1(pma)] =
+            leaf_pte((void*)pma, PTE_R | PTE_W | PTE_G);
+    }
+
+    // RAM above the third gigarange mapped at RAM_HIGH_VMA in 1GB gigapages,
+    // and the part of it that does not fill a whole gigarange in 2MB
+    // megapages.
+
+    for (pma = RAM_HIGH_PMA; pma + GIGA_SIZE <= RAM_END_PMA; pma += GIGA_SIZE) {
+        pp = pma_to_kva(pma);
+        main_pt2[VPN2((uintptr_t)pp)] = leaf_pte(pp, PTE_R | PTE_W | PTE_G);
+    }
+
+    if (pma < RAM_END_PMA) {
+        pp = pma_to_kva(pma);
+        main_pt2[VPN2((uintptr_t)pp)] = ptab_pte(main_pt1_ram_tail, PTE_G);
+
+        for (; pma < RAM_END_PMA; pma += MEGA_SIZE) {
+            pp = pma_to_kva(pma);
+            main_pt1_ram_tail[VPN1((uintptr_t)pp)] =
+                leaf_pte(pp, PTE_R | PTE_W | PTE_G);
+        }
     }
 
+    // Kernel virtual area (kvmalloc), filled in on demand
+
+    main_pt2[VPN2(KVM_START_VMA)] = ptab_pte(main_pt1_kvm, PTE_G);
+
     // Enable paging. This part always makes me nervous.
 
     main_mtag =  // Sv39
@@ -209,6 +438,17 @@ void memory_init(void) {
     csrw_satp(main_mtag);
     sfence_vma();
 
+    // Find out how many ASID bits are implemented: the unimplemented ones
+    // read back as zero. All kernel mappings are global, so changing the
+    // ASID of the main memory space here is harmless.
+
+    csrw_satp(main_mtag | (MTAG_ASID_MASK << RISCV_SATP_ASID_shift));
+    asid_cnt = MIN(MTAG_ASID(csrr_satp()) + 1, NASID);
+    csrw_satp(main_mtag);
+    sfence_vma();
+
+    asid0_mtag[0] = main_mtag;
+
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
     // HEAP_INIT_MIN bytes.
@@ -220,9 +460,20 @@ void memory_init(void) {
             HEAP_INIT_MIN - (heap_end - heap_start), PAGE_SIZE);
     }
 
-    if (RAM_END < heap_end)
+    // The frame table follows the heap. Only the entries of the frames in
+    // use so far are initialized; the rest of RAM is handed out by bump_alloc
+    // on demand. Frames of the kernel image, heap and frame table are never
+    // marked free, so no block will ever coalesce with them.
+
+    frametab = heap_end;
+    pp = heap_end + round_up_size(NFRAME * sizeof(struct frame), PAGE_SIZE);
+
+    if (RAM_END_PMA < kva_to_pma(pp))
         panic("Not enough memory");
     
+    bump_fn = pageptr_to_framenum(pp);
+    memset(frametab, 0, bump_fn * sizeof(struct frame));
+
     // Initialize heap memory manager
 
     heap_init(heap_start, heap_end);
@@ -230,23 +481,12 @@ void memory_init(void) {
     kprintf("Heap allocator: [%p,%p): %zu KB free\n",
         heap_start, heap_end, (heap_end - heap_start) / 1024);
 
-    free_list = heap_end; // heap_end is page aligned
-    page_cnt = (RAM_END - heap_end) / PAGE_SIZE;
+    page_cnt = (RAM_END_PMA - kva_to_pma(pp)) / PAGE_SIZE;
 
     kprintf("Page allocator: [%p,%p): %lu pages free\n",
-        free_list, RAM_END, page_cnt);
-
-    // Put free pages on the free page list
-    // TODO: FIXME implement this (must work with your implementation of
-    // memory_alloc_page and memory_free_page).
+        pp, RAM_END, page_cnt);
 
-    for (pp = heap_end + PAGE_SIZE; pp < RAM_END; pp += PAGE_SIZE){
-        memory_free_page(pp);
-    }
-    // Should place pages in the correct order.
-    // for (pp = RAM_END - PAGE_SIZE; pp >= heap_end; pp -= PAGE_SIZE){
-    //     memory_free_page(pp);
-    // }
+    page_total = free_low = page_cnt;
     
     // Allow supervisor to access user memory. We could be more precise by only
     // enabling it when we are accessing user memory, and disable it at other
@@ -254,36 +494,308 @@ void memory_init(void) {
 
     csrs_sstatus(RISCV_SSTATUS_SUM);
 
+    lock_init(&pager_lock, "pager");
+    lock_init(&swap_lock, "swap");
+
+    shared_zero_page = memory_alloc_page();
+
     memory_initialized = 1;
 }
 
+void memory_init_hart(void) {
+    trace("%s()", __func__);
+    assert (memory_initialized);
+
+    csrw_satp(main_mtag);
+    sfence_vma();
+    asid0_mtag[running_hart()] = main_mtag;
+    csrs_sstatus(RISCV_SSTATUS_SUM);
+}
+
 // Allocates a physical page of memory.
 // Returns a pointer to the direct-mapped address of the page.
 // Does not fail; panics if there are no free pages available.
 void * memory_alloc_page(void) {
+    void * pp;
+
     trace("%s()", __func__);
 
-    // Allocate a page from the free list
-    if(free_list == NULL){
-        panic("Out of physical memory");
-        kprintf("out of physical memory");
+    // Prefer a page that was zeroed while the CPU was idle
+
+    pp = zeroed_pool_pop();
+
+    if (pp == NULL) {
+        pp = memory_alloc_page_unzeroed();
+        zero_page(pp);
+    }
+
+    return pp;
+}
+
+// Allocates a physical page without clearing it, for callers that overwrite
+// the whole page anyway. Dirty pages are used first so that the zeroed pool is
+// left for memory_alloc_page.
+void * memory_alloc_page_unzeroed(void) {
+    void * pp;
+
+    trace("%s()", __func__);
+
+    // When memory runs out, shrink the balloon or push user pages out to
+    // swap until one frees up
+
+    while ((pp = alloc_block(0)) == NULL && (pp = zeroed_pool_pop()) == NULL) {
+        if (!reclaim_page())
+            panic("Out of physical memory");
     }
-    void *pp = free_list->padding;
-    free_list = free_list->next;
-    // Zero out the allocated page before use
-    memset(pp, 0, PAGE_SIZE);
+    
+    return pp;
+}
+
+// Allocates a physical page without clearing it if one is free. Returns NULL
+// instead of reclaiming memory when there is none.
+void * memory_alloc_page_nowait(void) {
+    void * pp;
+
+    trace("%s()", __func__);
+
+    pp = alloc_block(0);
+
+    if (pp == NULL)
+        pp = zeroed_pool_pop();
+    
     return pp;
 }
 
+// Returns the number of physical pages that can be allocated without
+// reclaiming any.
+size_t memory_free_page_cnt(void) {
+    return free_cnt + zeroed_cnt + (NFRAME - bump_fn);
+}
+
+// Fills in the page allocator, page table, swap and fault counters.
+void memory_get_stats(struct memory_stats * st) {
+    st->total = page_total;
+    st->free = memory_free_page_cnt();
+    st->zeroed = zeroed_cnt;
+    st->peak = page_total - free_low;
+    st->ptab = ptab_cnt;
+    st->swap_total = swap_nslot;
+    st->swap_used = swap_used;
+    st->minflt = minflt_cnt;
+    st->majflt = majflt_cnt;
+}
+
 // Returns a physical memory page to the physical page allocator.
 // The page must have been previously allocated by memory_alloc_page.
 void memory_free_page(void * pp) {
-    trace("%s(%p)", __func__, pp);
+    memory_free_pages(pp, 0);
+}
+
+// Allocates a block of 2^order physically contiguous pages from the buddy
+// allocator and clears it.
+void * memory_alloc_pages(unsigned int order) {
+    void * blk;
+    unsigned int k;
+
+    trace("%s(%u)", __func__, order);
+
+    if (order == 0)
+        return memory_alloc_page();
+
+    if (PAGE_MAX_ORDER < order)
+        panic("page alloc request too large");
+
+    // Pages sitting in the zeroed pool may be the missing buddies of a large
+    // enough block, so give them back before giving up.
+
+    blk = alloc_block(order);
+
+    if (blk == NULL) {
+        zeroed_pool_drain();
+        blk = alloc_block(order);
+    }
+
+    // Reclaiming pages may free the rest of a block. Give up after a
+    // reasonable number of tries, as the freed pages may be scattered.
+
+    for (k = 0; blk == NULL && k < (2U << order) && reclaim_page(); k++)
+        blk = alloc_block(order);
+
+    if (blk == NULL)
+        panic("Out of physical memory");
+
+    for (k = 0; k < (1U << order); k++)
+        zero_page(blk + k * PAGE_SIZE);
+
+    return blk;
+}
+
+// Returns a block of 2^order pages to the buddy allocator, merging it with its
+// buddy for as long as the buddy is also free.
+void memory_free_pages(void * pp, unsigned int order) {
+    uintptr_t n, bn;
+    struct frame * bfr;
+
+    trace("%s(%p,%u)", __func__, pp, order);
+
+    assert (aligned_ptr(pp, PAGE_SIZE));
+    assert (!(pageptr_to_frame(pp)->flags & FRAME_FREE));
+
+    n = pageptr_to_framenum(pp);
+
+    while (order < PAGE_MAX_ORDER) {
+        bn = n ^ (1UL << order);
+        if (bump_fn <= bn)
+            break;
+        
+        bfr = &frametab[bn];
+        if (!(bfr->flags & FRAME_FREE) || bfr->order != order)
+            break;
+        
+        free_list_remove(framenum_to_pageptr(bn), order);
+        n &= ~(1UL << order);
+        order += 1;
+    }
+
+    free_list_push(framenum_to_pageptr(n), order);
+}
+
+// Maps /size/ bytes, rounded up to whole pages, of newly allocated physical
+// pages at the first free range of the kernel virtual area that leaves room
+// for an unmapped guard page after it. The pages need not be contiguous.
+// Returns NULL if no range is large enough.
+void * memory_kvm_alloc(size_t size) {
+    const size_t cnt = round_up_size(size, PAGE_SIZE) / PAGE_SIZE;
+    uintptr_t vma, addr;
+    size_t n, run;
+    struct pte * pt0;
+
+    trace("%s(%zu)", __func__, size);
+
+    // First fit, skipping words of kvm_map that are all in use
+
+    run = 0;
+    for (n = 0; n < KVM_NPAGE && run < cnt + 1; n++) {
+        if (run == 0 && n % 64 == 0 && kvm_map[n / 64] == ~0UL)
+            n += 63;
+        else if (kvm_map[n / 64] & (1UL << (n % 64)))
+            run = 0;
+        else
+            run += 1;
+    }
 
-    // Return the page to the free list
-    union linked_page * newPage = (union linked_page *)pp;
-    newPage->next = free_list;
-    free_list = newPage;
+    if (run < cnt + 1)
+        return NULL;
+    
+    n -= cnt + 1;
+    vma = KVM_START_VMA + n * PAGE_SIZE;
+
+    for (addr = vma; addr < vma + cnt * PAGE_SIZE; addr += PAGE_SIZE) {
+        pt0 = walk_pt0(main_pt2, addr, 1);
+        pt0[VPN0(addr)] = leaf_pte(memory_alloc_page(), PTE_R | PTE_W | PTE_G);
+        kvm_map[n / 64] |= 1UL << (n % 64);
+        n += 1;
+    }
+
+    kvm_map[n / 64] |= 1UL << (n % 64); // guard page
+    return (void *)vma;
+}
+
+// Unmaps and frees the pages of an allocation made by memory_kvm_alloc, up to
+// the guard page that ends it. The mappings are global, so they are flushed
+// from the TLB for all ASIDs.
+void memory_kvm_free(void * vp) {
+    uintptr_t addr = (uintptr_t)vp;
+    struct pte * pt0;
+    size_t n;
+
+    trace("%s(%p)", __func__, vp);
+
+    assert (KVM_START_VMA <= addr && addr < KVM_END_VMA);
+    assert (aligned_addr(addr, PAGE_SIZE));
+
+    n = (addr - KVM_START_VMA) / PAGE_SIZE;
+
+    for (;;) {
+        pt0 = walk_pt0(main_pt2, addr, 0);
+
+        if (pt0 == NULL || verify_flags(pt0[VPN0(addr)].flags) != 0)
+            break;
+        
+        memory_free_page(pagenum_to_pageptr(pt0[VPN0(addr)].ppn));
+        pt0[VPN0(addr)] = null_pte();
+        asm inline ("sfence.vma %0, zero" :: "r" (addr) : "memory");
+        kvm_map[n / 64] &= ~(1UL << (n % 64));
+        addr += PAGE_SIZE;
+        n += 1;
+    }
+
+    assert (addr != (uintptr_t)vp);
+    kvm_map[n / 64] &= ~(1UL << (n % 64)); // guard page
+
+    // Other harts only use kernel mappings while holding the kernel lock,
+    // which we hold, so it is fine that the pages are already free.
+
+    smp_tlb_shootdown();
+}
+
+// Returns the order a block of pages was allocated with.
+unsigned int memory_block_order(const void * pp) {
+    const struct frame * const fr = pageptr_to_frame(pp);
+
+    assert (aligned_ptr(pp, PAGE_SIZE) && !(fr->flags & FRAME_FREE));
+    return fr->order;
+}
+
+// Zeroes one free page and moves it to the zeroed pool. Called by the idle
+// thread with interrupts enabled. Returns 1 if a page was zeroed, or 0 if the
+// pool is full or there are no dirty pages left.
+int memory_prezero_page(void) {
+    union linked_page * pp;
+
+    if (ZERO_POOL_MAX <= zeroed_cnt)
+        return 0;
+    
+    pp = alloc_block(0);
+
+    if (pp == NULL)
+        return 0;
+    
+    zero_page(pp);
+
+    pageptr_to_frame(pp)->refcnt = 0;
+    pp->next = zeroed_pool;
+    zeroed_pool = pp;
+    zeroed_cnt += 1;
+
+    return 1;
+}
+
+// Starts swapping user pages out to /io/ when memory runs low. The whole
+// device is used as swap space.
+void memory_swap_init(struct io_intf * io) {
+    uint64_t len;
+
+    trace("%s(%p)", __func__, io);
+
+    if (ioctl(io, IOCTL_GETLEN, &len) != 0 || len < PAGE_SIZE) {
+        kprintf("Swap device unusable\n");
+        return;
+    }
+
+    swap_nslot = len / PAGE_SIZE;
+    swap_refcnt = kvmalloc(swap_nslot);
+    memset(swap_refcnt, 0, swap_nslot);
+    swap_io = io;
+
+    kprintf("          Swap: %zu pages\n", swap_nslot);
+}
+
+// Lets memory_alloc_page and memory_alloc_pages call /deflate/ to get pages
+// back from the balloon driver before they resort to swapping.
+void memory_balloon_init(size_t (*deflate)(size_t cnt)) {
+    trace("%s(%p)", __func__, deflate);
+    balloon_deflate = deflate;
 }
 
 // Allocates and maps a physical page.
@@ -293,55 +805,184 @@ void memory_free_page(void * pp) {
 void * memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags) {
     trace("%s(0x%lx, 0x%x)", __func__, vma, rwxug_flags);
 
-
-    // Allocate a physical page
-    walk_pt(active_space_root(), vma, 1);
-    memory_set_page_flags((void * )vma, rwxug_flags);
-    sfence_vma();
-
-    return (void *)vma;
+    return memory_alloc_and_map_range(vma, PAGE_SIZE, rwxug_flags);
 }
 
 // Allocates and maps multiple physical pages in an address range.
-// Equivalent to calling memory_alloc_and_map_page for every page in the range.
+// Equivalent to calling memory_alloc_and_map_page for every page in the range,
+// but each level-0 table is looked up once per run of pages and the TLB is
+// flushed once at the end. Pages that are already mapped keep their physical
+// page and get the new flags, except that a shared COW page stays read-only.
 void * memory_alloc_and_map_range(uintptr_t vma, size_t size, uint_fast8_t rwxug_flags) {
     trace("%s(0x%lx, %zu, 0x%x)", __func__, vma, size, rwxug_flags);
 
-    uintptr_t addr = vma;
-    uintptr_t end = vma + size;
+    struct pte * const root = active_space_root();
+    uintptr_t addr = round_down_addr(vma, PAGE_SIZE);
+    const uintptr_t end = round_up_addr(vma + size, PAGE_SIZE);
+    struct pte * pt0;
+    long cnt = 0;
+    int k;
 
-    // Allocate and map each page in the range
     while (addr < end) {
-        memory_alloc_and_map_page(addr, rwxug_flags);
-        addr += PAGE_SIZE;
+        // Use a megapage for an aligned 2 MB run if a block is available
+        if (aligned_addr(addr, MEGA_SIZE) && MEGA_SIZE <= end - addr &&
+            (rwxug_flags & PTE_U) && map_megapage(root, addr, rwxug_flags))
+        {
+            addr += MEGA_SIZE;
+            continue;
+        }
+
+        pt0 = walk_pt0(root, addr, 1);
+
+        // Fill this level-0 table up to its end or the end of the range
+        for (k = VPN0(addr); k < PTE_CNT && addr < end; k++) {
+            if (verify_flags(pt0[k].flags) != 0) {
+                if (pte_swapped(&pt0[k]))
+                    swap_slot_unref(pt0[k].ppn);
+                pt0[k] = leaf_pte(memory_alloc_page(), rwxug_flags);
+                frame_set_owner(pagenum_to_pageptr(pt0[k].ppn), addr);
+                cnt += 1;
+            } else
+                set_leaf_flags(&pt0[k], rwxug_flags);
+            addr += PAGE_SIZE;
+        }
     }
+
+    if (rwxug_flags & PTE_U)
+        rss_add(active_space_mtag(), cnt);
+
+    sfence_vma_range(vma, size);
     return (void *)vma;
 }
 
-// Changes the PTE flags for all pages in a mapped range.
+// Changes the PTE flags for all pages in a mapped range. Panics if a page in
+// the range is not mapped.
 void memory_set_range_flags(const void * vp, size_t size, uint_fast8_t rwxug_flags) {
     trace("%s(%p, %zu, 0x%x)", __func__, vp, size, rwxug_flags);
 
-    uintptr_t addr = (uintptr_t)vp;
-    uintptr_t end = addr + size;
+    struct pte * const root = active_space_root();
+    uintptr_t addr = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+    const uintptr_t end = round_up_addr((uintptr_t)vp + size, PAGE_SIZE);
+    struct pte * pt1;
+    struct pte * pt0;
+    int k;
 
-    // Update the flags for each page in the range
     while (addr < end) {
-        memory_set_page_flags((const void *)addr, rwxug_flags);
-        addr += PAGE_SIZE;
+        pt1 = walk_pt1(root, addr, 0);
+
+        if (pt1 == NULL || verify_flags(pt1[VPN1(addr)].flags) != 0)
+            panic("Invalid page table entry");
+
+        // A megapage is changed as a whole if the range covers it and is
+        // split into pages otherwise.
+        if (pte_is_leaf(&pt1[VPN1(addr)])) {
+            if (aligned_addr(addr, MEGA_SIZE) && MEGA_SIZE <= end - addr) {
+                set_leaf_flags(&pt1[VPN1(addr)], rwxug_flags);
+                addr += MEGA_SIZE;
+                continue;
+            }
+            pt0 = split_megapage(&pt1[VPN1(addr)], addr);
+        } else
+            pt0 = pagenum_to_pageptr(pt1[VPN1(addr)].ppn);
+
+        for (k = VPN0(addr); k < PTE_CNT && addr < end; k++) {
+            // Swapped-out pages get the new flags when swapped back in
+            if (verify_flags(pt0[k].flags) != 0 && !pte_swapped(&pt0[k]))
+                panic("Invalid page table entry");
+            set_leaf_flags(&pt0[k], rwxug_flags);
+            addr += PAGE_SIZE;
+        }
     }
+
+    sfence_vma_range((uintptr_t)vp, size);
 }
 
-// Unmaps and frees all pages with the U bit set in the PTE flags.
+// Unmaps and frees all pages with the U bit set in the PTE flags. Walks the
+// page table tree under the user window, skipping empty subtrees, and frees the
+// level-1 and level-0 tables that end up empty.
 void memory_unmap_and_free_user(void) {
     trace("%s()", __func__);
 
-    // Unmap and free all user pages
-    for(uintptr_t vma = USER_START_VMA; vma < USER_END_VMA; vma += PAGE_SIZE){
-        unmap_user_page(vma);
-        //TODO CP3: maybe unmap intermediate page tables
+    struct pte * const root = active_space_root();
+    const uintptr_t last = USER_END_VMA - 1;
+    uintptr_t base;
+    struct pte * pt1;
+    int i, lo, hi;
+
+    for (i = VPN2(USER_START_VMA); i <= VPN2(last); i++) {
+        // Skip empty entries and kernel gigapages
+        if (verify_flags(root[i].flags) != 0 || (root[i].flags & PTE_G) ||
+            (root[i].flags & (PTE_R | PTE_W | PTE_X)) != 0)
+            continue;
+
+        // Only the part of this gigabyte inside the user window
+        base = (uintptr_t)i << (9+9+12);
+        lo = (base < USER_START_VMA) ? VPN1(USER_START_VMA) : 0;
+        hi = (base + GIGA_SIZE - 1 > last) ? VPN1(last) : PTE_CNT - 1;
+
+        pt1 = pagenum_to_pageptr(root[i].ppn);
+        if (free_user_pt1(pt1, lo, hi, base)) {
+            root[i] = null_pte();
+            free_ptab(pt1);
+        }
     }
-    sfence_vma();
+
+    sfence_vma_asid(active_space_asid());
+}
+
+// Unmaps the user pages in a range and drops their references. Unmapped pages
+// are skipped, and a megapage only partly inside the range is split first.
+void memory_unmap_and_free_range(void * vp, size_t size) {
+    trace("%s(%p, %zu)", __func__, vp, size);
+
+    struct pte * const root = active_space_root();
+    uintptr_t addr = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+    const uintptr_t end = round_up_addr((uintptr_t)vp + size, PAGE_SIZE);
+    struct pte * pt1;
+    struct pte * pt0;
+    int k;
+
+    while (addr < end) {
+        pt1 = walk_pt1(root, addr, 0);
+
+        if (pt1 == NULL) {
+            addr = round_down_addr(addr, GIGA_SIZE) + GIGA_SIZE;
+            continue;
+        }
+
+        if (verify_flags(pt1[VPN1(addr)].flags) != 0 ||
+            (!(pt1[VPN1(addr)].flags & PTE_U) && pte_is_leaf(&pt1[VPN1(addr)])))
+        {
+            addr = round_down_addr(addr, MEGA_SIZE) + MEGA_SIZE;
+            continue;
+        }
+
+        if (pte_is_leaf(&pt1[VPN1(addr)])) {
+            if (aligned_addr(addr, MEGA_SIZE) && MEGA_SIZE <= end - addr) {
+                page_unref(pagenum_to_pageptr(pt1[VPN1(addr)].ppn));
+                pt1[VPN1(addr)] = null_pte();
+                rss_add(active_space_mtag(), -(long)(MEGA_SIZE / PAGE_SIZE));
+                addr += MEGA_SIZE;
+                continue;
+            }
+            pt0 = split_megapage(&pt1[VPN1(addr)], addr);
+        } else
+            pt0 = pagenum_to_pageptr(pt1[VPN1(addr)].ppn);
+
+        for (k = VPN0(addr); k < PTE_CNT && addr < end; k++) {
+            if (verify_flags(pt0[k].flags) == 0 && (pt0[k].flags & PTE_U)) {
+                page_unref(pagenum_to_pageptr(pt0[k].ppn));
+                pt0[k] = null_pte();
+                rss_add(active_space_mtag(), -1);
+            } else if (pte_swapped(&pt0[k])) {
+                swap_slot_unref(pt0[k].ppn);
+                pt0[k] = null_pte();
+            }
+            addr += PAGE_SIZE;
+        }
+    }
+
+    sfence_vma_range((uintptr_t)vp, size);
 }
 
 // Checks if a virtual address range is mapped with specified flags.
@@ -352,89 +993,418 @@ int memory_validate_vptr_len(const void * vp, size_t len, uint_fast8_t rwxug_fla
     uintptr_t addr = (uintptr_t)vp;
     uintptr_t end = addr + len;
 
+    size_t size;
+
     // Check each page in the range
     while (addr < end) {
-        struct pte *pte = walk_pt(active_space_root(), addr, 0);
+        struct pte *pte = find_leaf(active_space_root(), addr, &size);
+        if (!pte && fault_in(round_down_addr(addr, PAGE_SIZE), PTE_R))
+            pte = find_leaf(active_space_root(), addr, &size);
         if (!pte || verify_flags(pte->flags) != 0 || ((pte->flags & rwxug_flags) != rwxug_flags)) {
             // Validation failed
             return 0;
         }
-        addr += PAGE_SIZE;
+        addr = round_down_addr(addr, size) + size;
     }
     // All pages validated successfully
     return 1;
 }
 
 // Checks if the virtual pointer points to a mapped range containing a null-terminated string.
-// Returns 0 if the string is valid and accessible with the specified flags.
+// Returns 1 if the string is valid and accessible with the specified flags.
+// Each page of the string is looked up once.
 int memory_validate_vstr(const char * vs, uint_fast8_t ug_flags) {
     trace("%s(%p, 0x%x)", __func__, vs, ug_flags);
 
     uintptr_t addr = (uintptr_t)vs;
+    const char * kp;
+    size_t n;
 
-    // Iterate over the string
     while (1) {
-        struct pte *pte = walk_pt(active_space_root(), addr, 0);
-        if (!pte || verify_flags(pte->flags) != 0 || ((pte->flags & ug_flags) != ug_flags)) {
-            // Validation failed
+        kp = user_page_ptr(addr, ug_flags);
+        if (kp == NULL)
             return 0;
+
+        // Scan to the end of this page
+        n = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+        while (n-- > 0) {
+            if (*kp++ == '\0')
+                return 1;
+            addr++;
         }
-        char c = *(char *)((uintptr_t)pagenum_to_pageptr(pte->ppn) | (0xFFF & addr));
-        if (c == 0) {
-            // Null terminator found; valid string
-            return 1;
-        }
-        addr++;
     }
 }
 
-// Called from excp.c to handle a page fault at the specified address.
-// Either maps a page containing the faulting address, or calls process_exit().
-void memory_handle_page_fault(const void * vptr) {
-    trace("%s(%p)", __func__, vptr);
+// Copies /n/ bytes from user memory at /usrc/ to kernel memory at /dst/.
+// Returns 0 on success or -EACCESS if part of the source is not readable
+// user memory.
+int copy_from_user(void * dst, const void * usrc, size_t n) {
+    trace("%s(%p, %p, %zu)", __func__, dst, usrc, n);
+
+    uintptr_t addr = (uintptr_t)usrc;
+    const void * kp;
+    size_t cnt;
+
+    while (n > 0) {
+        kp = user_page_ptr(addr, PTE_R | PTE_U);
+        if (kp == NULL)
+            return -EACCESS;
+
+        cnt = MIN(n, PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+        memcpy(dst, kp, cnt);
+        dst += cnt;
+        addr += cnt;
+        n -= cnt;
+    }
 
-    uintptr_t addr = (uintptr_t)vptr & ~(PAGE_SIZE - 1); // Align to page boundary
+    return 0;
+}
 
-    // Check if the address is within user space
-    if (addr >= USER_BASE && addr < USER_TOP) {
-        // Map a new page with user read/write permissions
-        memory_alloc_and_map_page(addr, (PTE_U | PTE_R | PTE_W));
-        sfence_vma();
-        
-    } else {
-        // Invalid access; terminate the process
-        panic("page fault!");
+// Copies /n/ bytes from kernel memory at /src/ to user memory at /udst/.
+// Returns 0 on success or -EACCESS if part of the destination is not writable
+// user memory.
+int copy_to_user(void * udst, const void * src, size_t n) {
+    trace("%s(%p, %p, %zu)", __func__, udst, src, n);
+
+    uintptr_t addr = (uintptr_t)udst;
+    void * kp;
+    size_t cnt;
+
+    while (n > 0) {
+        kp = user_page_ptr(addr, PTE_W | PTE_U);
+        if (kp == NULL)
+            return -EACCESS;
+
+        cnt = MIN(n, PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+        memcpy(kp, src, cnt);
+        src += cnt;
+        addr += cnt;
+        n -= cnt;
     }
+
+    return 0;
 }
 
-uintptr_t memory_space_create(uint_fast16_t asid){
-    uintptr_t cur_mtag = memory_space_switch(main_mtag);
-    uintptr_t new_mtag = memory_space_clone(asid);
-    memory_space_switch(cur_mtag);
-    return new_mtag;
+// Copies a null-terminated string of at most /n/ bytes, including the null
+// byte, from user memory. Returns the length of the string, -EACCESS if it
+// is not readable user memory, or -EINVAL if it does not fit.
+long strncpy_from_user(char * dst, const char * usrc, size_t n) {
+    trace("%s(%p, %p, %zu)", __func__, dst, usrc, n);
+
+    uintptr_t addr = (uintptr_t)usrc;
+    const char * kp;
+    size_t cnt;
+    long len = 0;
+
+    while (n > 0) {
+        kp = user_page_ptr(addr, PTE_R | PTE_U);
+        if (kp == NULL)
+            return -EACCESS;
+
+        cnt = MIN(n, PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+        addr += cnt;
+        n -= cnt;
+
+        while (cnt-- > 0) {
+            if ((*dst++ = *kp++) == '\0')
+                return len;
+            len++;
+        }
+    }
+
+    return -EINVAL;
 }
 
-// Switches the active memory space to the main memory space and reclaims the
-// memory space that was active on entry. All physical pages mapped by a user
-// mapping are reclaimed.
-void memory_space_reclaim(void) {
-    trace("%s()", __func__);
+// Records a demand-paged region in a region table. Returns 0 on success or
+// -EINVAL if the range is outside the user window or the table is full.
+int memory_region_add (
+    struct mem_region * tab, uintptr_t vma, size_t size, uint_fast8_t flags,
+    struct io_intf * io, uint64_t off, size_t len)
+{
+    trace("%s(%p, 0x%lx, %zu, 0x%x)", __func__, tab, vma, size, flags);
 
-    // Switch to the main memory space (kernel page table)
-    memory_unmap_and_free_user();
-    uintptr_t old_mtag = memory_space_switch(main_mtag);
-    sfence_vma(); // Flush the TLB
+    int i;
 
-    // Free the root page table of the old memory space
-    struct pte* old_root = mtag_to_root(old_mtag);
-    kprintf("freeing root at %x\n", old_root->ppn);
-    memory_free_page(old_root);
+    if (vma < USER_START_VMA || USER_END_VMA < vma + size || size < len)
+        return -EINVAL;
+
+    for (i = 0; i < MEMORY_REGION_MAX; i++) {
+        if (tab[i].start == tab[i].end)
+            break;
+    }
+
+    if (i == MEMORY_REGION_MAX)
+        return -EINVAL;
+
+    tab[i].start = round_down_addr(vma, PAGE_SIZE);
+    tab[i].end = round_up_addr(vma + size, PAGE_SIZE);
+    tab[i].flags = flags;
+    tab[i].io = io;
+    tab[i].file_vma = vma;
+    tab[i].file_off = off;
+    tab[i].file_len = len;
+
+    if (io != NULL)
+        ioref(io);
+
+    return 0;
 }
 
-/**
- * Name: memory_space_clone
- *
- * Inputs:
+// Copies a region table for a forked process, taking new file references.
+void memory_region_copy(struct mem_region * dst, const struct mem_region * src) {
+    int i;
+
+    for (i = 0; i < MEMORY_REGION_MAX; i++) {
+        dst[i] = src[i];
+        if (dst[i].start != dst[i].end && dst[i].io != NULL)
+            ioref(dst[i].io);
+    }
+}
+
+// Empties a region table and drops its file references.
+void memory_region_clear(struct mem_region * tab) {
+    int i;
+
+    for (i = 0; i < MEMORY_REGION_MAX; i++) {
+        if (tab[i].start != tab[i].end && tab[i].io != NULL)
+            ioclose(tab[i].io);
+        tab[i].start = tab[i].end = 0;
+        tab[i].io = NULL;
+    }
+}
+
+// Finds a page-aligned address in [lo,hi) where /size/ bytes fit without
+// overlapping a region of /tab/ or any mapped page. Returns 0 if there is none.
+uintptr_t memory_region_place (
+    const struct mem_region * tab, uintptr_t lo, uintptr_t hi, size_t size)
+{
+    struct pte * const root = active_space_root();
+    uintptr_t vma = round_up_addr(lo, PAGE_SIZE);
+    uintptr_t addr, end;
+    size_t pgsize;
+    int i, moved;
+
+    size = round_up_size(size, PAGE_SIZE);
+
+    do {
+        if (size == 0 || hi < vma || hi - vma < size)
+            return 0;
+
+        end = vma + size;
+        moved = 0;
+
+        for (i = 0; i < MEMORY_REGION_MAX && !moved; i++) {
+            if (tab[i].start < end && vma < tab[i].end) {
+                vma = tab[i].end;
+                moved = 1;
+            }
+        }
+
+        for (addr = vma; addr < end && !moved; addr += PAGE_SIZE) {
+            if (find_leaf(root, addr, &pgsize) != NULL) {
+                vma = round_down_addr(addr, pgsize) + pgsize;
+                moved = 1;
+            }
+        }
+    } while (moved);
+
+    return vma;
+}
+
+// Removes the region starting at /vma/ from /tab/, unmapping its pages and
+// dropping its file reference.
+int memory_region_remove(struct mem_region * tab, uintptr_t vma) {
+    trace("%s(%p, 0x%lx)", __func__, tab, vma);
+
+    int i;
+
+    for (i = 0; i < MEMORY_REGION_MAX; i++) {
+        if (tab[i].start != tab[i].end && tab[i].start == vma)
+            break;
+    }
+
+    if (i == MEMORY_REGION_MAX)
+        return -EINVAL;
+
+    memory_unmap_and_free_range((void *)tab[i].start, tab[i].end - tab[i].start);
+
+    if (tab[i].io != NULL)
+        ioclose(tab[i].io);
+
+    tab[i].start = tab[i].end = 0;
+    tab[i].io = NULL;
+    return 0;
+}
+
+// Called from excp.c to handle a page fault at the specified address.
+// Either maps a page containing the faulting address, breaks copy-on-write
+// sharing of the page, or calls process_exit().
+void memory_handle_page_fault(const void * vptr, uint_fast8_t access) {
+    trace("%s(%p, 0x%x)", __func__, vptr, access);
+
+    uintptr_t addr = (uintptr_t)vptr & ~(PAGE_SIZE - 1); // Align to page boundary
+    struct process * const proc = current_process();
+    struct mem_region * rgn;
+    struct pte * pte;
+    size_t size;
+    int major = 0;
+
+    // Check if the address is within user space
+    if (addr >= USER_START_VMA && addr < USER_END_VMA) {
+        pte = find_leaf(active_space_root(), addr, &size);
+
+        if (pte == NULL) {
+            // Swap in, or else map the page and some of its neighbours from
+            // a demand-paged region or as anonymous user read/write pages.
+            // If that fills up its 2 MB region, try to turn the region into
+            // a megapage.
+            if (swap_in_page(addr))
+                major = 1;
+            else {
+                rgn = find_region(addr);
+                major = (rgn != NULL && rgn->io != NULL);
+                fault_around(addr, access);
+            }
+            promote_megapage(active_space_root(), addr);
+        } else if ((pte->flags & PTE_A) == 0 || (access == PTE_W &&
+            (pte->flags & (PTE_W | PTE_D)) == PTE_W))
+        {
+            // The accessed or dirty bit is clear (new mapping, page-out clock
+            // or sampler) and the hart does not set it in hardware.
+            pte->flags |= PTE_A;
+            if (access == PTE_W && (pte->flags & PTE_W))
+                pte->flags |= PTE_D;
+            sfence_vma_range(addr, PAGE_SIZE);
+        } else if (pte->rsw & PTE_RSW_COW) {
+            // Store to a page shared with another memory space or to the
+            // shared zero page
+            if (size == MEGA_SIZE)
+                mega_cow_break(pte, addr);
+            else
+                cow_break(pte, addr);
+        } else {
+            // Page is mapped, but not with the permissions needed
+            kprintf("Access violation at %p\n", vptr);
+            process_exit();
+        }
+
+        // A fault that had to read the page from swap or a file is major
+        if (major) {
+            majflt_cnt += 1;
+            if (proc != NULL)
+                proc->majflt += 1;
+        } else {
+            minflt_cnt += 1;
+            if (proc != NULL)
+                proc->minflt += 1;
+        }
+    } else {
+        // Invalid access; terminate the process
+        panic("page fault!");
+    }
+}
+
+uintptr_t memory_space_create(uint_fast16_t asid){
+    uintptr_t cur_mtag = memory_space_switch(main_mtag);
+    uintptr_t new_mtag = memory_space_clone(asid);
+    memory_space_switch(cur_mtag);
+    return new_mtag;
+}
+
+// Switches the active memory space to the main memory space and reclaims the
+// memory space that was active on entry. All physical pages mapped by a user
+// mapping are reclaimed.
+void memory_space_reclaim(void) {
+    trace("%s()", __func__);
+
+    // Switch to the main memory space (kernel page table)
+    memory_unmap_and_free_user();
+    uintptr_t old_mtag = memory_space_switch(main_mtag);
+
+    // Drop any TLB entries still tagged with the old ASID, on this hart and
+    // the others, before it can be handed to another memory space.
+    sfence_vma_asid(MTAG_ASID(old_mtag));
+    smp_tlb_shootdown();
+    memory_asid_free(MTAG_ASID(old_mtag));
+
+    // Free the root page table of the old memory space
+    struct pte* old_root = mtag_to_root(old_mtag);
+    debug("freeing root at %p", old_root);
+    free_ptab(old_root);
+}
+
+void memory_space_flush(uintptr_t mtag) {
+    trace("%s(0x%lx)", __func__, mtag);
+    sfence_vma_asid(MTAG_ASID(mtag));
+}
+
+// Counts the user pages mapped in the memory space /mtag/ and how many of them
+// were accessed or written since the last call, then clears their accessed and
+// dirty bits. A megapage counts as MEGA_SIZE / PAGE_SIZE pages.
+void memory_space_sample(uintptr_t mtag, struct memory_sample * smp) {
+    struct pte * const root = mtag_to_root(mtag);
+    struct pte * pt1;
+    struct pte * pt0;
+    int i, j, k;
+
+    trace("%s(0x%lx)", __func__, mtag);
+
+    memset(smp, 0, sizeof(struct memory_sample));
+
+    for (i = VPN2(USER_START_VMA); i <= VPN2(USER_END_VMA - 1); i++) {
+        if (verify_flags(root[i].flags) != 0 || pte_is_leaf(&root[i]))
+            continue;
+        
+        pt1 = pagenum_to_pageptr(root[i].ppn);
+
+        for (j = 0; j < PTE_CNT; j++) {
+            if (verify_flags(pt1[j].flags) != 0)
+                continue;
+            
+            if (pte_is_leaf(&pt1[j])) {
+                sample_leaf(&pt1[j], MEGA_SIZE / PAGE_SIZE, smp);
+                continue;
+            }
+
+            pt0 = pagenum_to_pageptr(pt1[j].ppn);
+
+            for (k = 0; k < PTE_CNT; k++) {
+                if (verify_flags(pt0[k].flags) == 0) {
+                    sample_leaf(&pt0[k], 1, smp);
+                    frame_claim(&pt0[k], ((uintptr_t)i << (9+9+12)) |
+                        ((uintptr_t)j << (9+12)) | ((uintptr_t)k << 12), mtag);
+                }
+            }
+        }
+    }
+
+    // The process may be running on another hart, which would not set the
+    // accessed bits again while it has the translations cached
+
+    sfence_vma_asid(MTAG_ASID(mtag));
+    smp_tlb_shootdown();
+}
+
+// Allocates an address space identifier for a new memory space. Returns 0,
+// the ASID of the main memory space, if all others are in use; spaces with
+// ASID 0 are still correct, but switching between them flushes the TLB.
+uint_fast16_t memory_asid_alloc(void) {
+    uint_fast16_t asid;
+
+    for (asid = 1; asid < asid_cnt; asid++) {
+        if ((asid_map[asid / 64] & (1UL << (asid % 64))) == 0) {
+            asid_map[asid / 64] |= 1UL << (asid % 64);
+            return asid;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Name: memory_space_clone
+ *
+ * Inputs:
  *  uint_fast16_t asid - Address space identifier 
  *
  * Outputs:
@@ -442,15 +1412,17 @@ void memory_space_reclaim(void) {
  *
  * Purpose:
  *  Duplicates the current process’s memory space, creating an independent copy for the child process.
+ *  User pages are not copied: writable pages are mapped read-only and copy-on-write in both spaces,
+ *  and are copied by memory_handle_page_fault on the first store.
  *
  * Side effects:
- *  Allocates page tables and memory pages and copy memory from parent to child. Ensures
- *  proper mappings in the child’s memory space.
+ *  Allocates page tables for the child and takes a reference on every user page it maps. Revokes
+ *  write permission on the parent's writable user pages.
  */
 uintptr_t memory_space_clone(uint_fast16_t asid){
     // TODO CP3: may need to not copy g flags?
     uintptr_t new_mtag = 0;
-    struct pte * new_root = (struct pte *)memory_alloc_page();
+    struct pte * new_root = (struct pte *)alloc_ptab();
     struct pte * root = active_space_root();
     for(int i = 0; i < PTE_CNT; i++){
         struct pte pt2_pte = root[i];
@@ -470,7 +1442,7 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
 
         // Handle next pt level
         if((pt2_pte.flags & (PTE_R | PTE_W | PTE_X)) == 0){
-            struct pte * new_pt1 = (struct pte *)memory_alloc_page();
+            struct pte * new_pt1 = (struct pte *)alloc_ptab();
             new_root[i].ppn = pageptr_to_pagenum((void *)new_pt1);
             struct pte * pt1 = pagenum_to_pageptr(pt2_pte.ppn);
 
@@ -482,46 +1454,67 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
                 }
 
                 new_pt1[j] = pt1_pte;
-                // Megapages only exist in the kernel mapping, so
+                // Global megapages belong to the kernel mapping, so
                 // their page content does not need to be copied.
 
                 if((pt1_pte.flags & PTE_G) != 0){
                     continue;
                 }
 
+                // User megapages are shared the same way as pages
+                if((pt1_pte.flags & (PTE_R | PTE_W | PTE_X)) != 0){
+                    if((pt1_pte.flags & PTE_W) != 0){
+                        pt1[j].flags &= ~PTE_W;
+                        pt1[j].rsw |= PTE_RSW_COW;
+                    }
+                    new_pt1[j] = pt1[j];
+                    page_ref(pagenum_to_pageptr(pt1_pte.ppn));
+                    continue;
+                }
+
                 // Handle next pt level
                 if((pt1_pte.flags & (PTE_R | PTE_W | PTE_X)) == 0){
-                    struct pte * new_pt0 = (struct pte *)memory_alloc_page();
+                    struct pte * new_pt0 = (struct pte *)alloc_ptab();
                     new_pt1[j].ppn = pageptr_to_pagenum((void *) new_pt0);
                     struct pte * pt0 = pagenum_to_pageptr(pt1_pte.ppn);
 
                     for(int k = 0; k < PTE_CNT; k++){
                         struct pte pt0_pte = pt0[k];
+                        // A swapped-out page is shared through its swap slot
+                        if(pte_swapped(&pt0_pte)){
+                            new_pt0[k] = pt0_pte;
+                            swap_refcnt[pt0_pte.ppn] += 1;
+                            continue;
+                        }
                         // If entry invalid, nothing to copy
                         if(verify_flags(pt0_pte.flags) != 0){
                             continue;
                         }
 
-                        new_pt0[k] = pt0_pte;
-
                         if((pt0_pte.flags & PTE_G) != 0){
+                            new_pt0[k] = pt0_pte;
                             continue;
                         }
 
-                        // Handle individual pages
-                        void * pma = memory_alloc_page();
-                        new_pt0[k].ppn = pageptr_to_pagenum(pma);
-                        // kprintf("allocing new leaf page\n");
-                        // kprintf("with vpn: %x\n", (((new_root[i].ppn & 0xFFF) << 18) | ((new_pt1[j].ppn & 0xFFF) << 9) | (new_pt0[k].ppn & 0xFFF)) << 12 );
-                        // kprintf("at pma %x\n", pma);
-                        memcpy(pma, pagenum_to_pageptr(pt0_pte.ppn), PAGE_SIZE);
+                        // Share individual pages. Writable pages become
+                        // read-only COW pages in both memory spaces.
+                        if((pt0_pte.flags & PTE_W) != 0){
+                            pt0[k].flags &= ~PTE_W;
+                            pt0[k].rsw |= PTE_RSW_COW;
+                        }
+
+                        new_pt0[k] = pt0[k];
+                        page_ref(pagenum_to_pageptr(pt0_pte.ppn));
                     }
                 }
             }
         }
     }
-    new_mtag = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) | (pageptr_to_pagenum((void *)new_root));
-    sfence_vma();
+    new_mtag = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) |
+        ((uintptr_t)asid << RISCV_SATP_ASID_shift) |
+        pageptr_to_pagenum((void *)new_root);
+    // Only the parent's PTEs changed (writable pages became COW)
+    sfence_vma_asid(active_space_asid());
     return new_mtag;
 }
 
@@ -532,18 +1525,7 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
 void memory_set_page_flags(const void *vp, uint8_t rwxug_flags) {
     trace("%s(%p, 0x%x)", __func__, vp, rwxug_flags);
 
-    // Retrieve the PTE for the given virtual address
-    struct pte *pte = walk_pt(active_space_root(), (uintptr_t)vp, 0);
-    if (pte && (verify_flags(pte->flags) == 0)) {
-        // Update the PTE flags, preserving V, A, and D flags
-        pte->flags = (pte->flags & (PTE_V | PTE_A | PTE_D)) | (rwxug_flags & (PTE_R | PTE_W | PTE_X | PTE_U | PTE_G));
-        // Flush the TLB to ensure changes take effect
-        sfence_vma();
-    } else {
-        // Invalid PTE; panic
-        memory_handle_page_fault(vp);
-        panic("Invalid page table entry");
-    }
+    memory_set_range_flags(vp, PAGE_SIZE, rwxug_flags);
 }
 
 static inline int wellformed_vma(uintptr_t vma) {
@@ -582,11 +1564,11 @@ static inline struct pte * active_space_root(void) {
 }
 
 static inline void * pagenum_to_pageptr(uintptr_t n) {
-    return (void*)(n << PAGE_ORDER);
+    return pma_to_kva(n << PAGE_ORDER);
 }
 
 static inline uintptr_t pageptr_to_pagenum(const void * p) {
-    return (uintptr_t)p >> PAGE_ORDER;
+    return kva_to_pma(p) >> PAGE_ORDER;
 }
 
 static inline void * round_up_ptr(void * p, size_t blksz) {
@@ -613,11 +1595,16 @@ static inline uintptr_t round_down_addr(uintptr_t addr, size_t blksz) {
     return (addr / blksz * blksz);
 }
 
+// User leaves start out with A and D clear so that memory_space_sample can
+// tell which pages are used. Kernel leaves have them set, as the kernel has no
+// handler for the faults a hart without hardware A/D updates would raise.
+
 static inline struct pte leaf_pte (
     const void * pptr, uint_fast8_t rwxug_flags)
 {
     return (struct pte) {
-        .flags = rwxug_flags | PTE_A | PTE_D | PTE_V,
+        .flags = rwxug_flags | PTE_V |
+            ((rwxug_flags & PTE_U) ? 0 : PTE_A | PTE_D),
         .ppn = pageptr_to_pagenum(pptr)
     };
 }
@@ -639,6 +1626,38 @@ static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
 
+// Flushes the non-global TLB entries tagged with /asid/. Kernel mappings are
+// global and are left alone.
+static inline void sfence_vma_asid(uint_fast16_t asid) {
+    asm inline ("sfence.vma zero, %0" :: "r" (asid) : "memory");
+}
+
+static inline uint_fast16_t active_space_asid(void) {
+    return MTAG_ASID(active_space_mtag());
+}
+
+// Flushes the TLB entries of the active ASID for the pages in a range.
+static void sfence_vma_range(uintptr_t vma, size_t size) {
+    const uint_fast16_t asid = active_space_asid();
+    uintptr_t addr = round_down_addr(vma, PAGE_SIZE);
+    const uintptr_t end = round_up_addr(vma + size, PAGE_SIZE);
+
+    if ((end - addr) / PAGE_SIZE > SFENCE_RANGE_MAX) {
+        sfence_vma_asid(asid);
+        return;
+    }
+
+    while (addr < end) {
+        asm inline ("sfence.vma %0, %1" :: "r" (addr), "r" (asid) : "memory");
+        addr += PAGE_SIZE;
+    }
+}
+
+static void memory_asid_free(uint_fast16_t asid) {
+    if (asid != 0)
+        asid_map[asid / 64] &= ~(1UL << (asid % 64));
+}
+
 // Ensures that the verify flag is set, and that the page
 // is not write-enabled while not being read-enabled.
 // Returns 0 on success, -1 on invalid.
@@ -653,22 +1672,478 @@ static inline int verify_flags(uint64_t flags){
     return 0;
 }
 
-static inline int unmap_user_page(uintptr_t vma){
-    struct pte* page = walk_pt(active_space_root(), vma, 0);
-    if(page == NULL){
-        return -EINVAL;
+// Unmaps the user pages of /pt1/ entries lo..hi, which map the gigabyte at
+// /base/. Frees level-0 tables that become empty. Returns 1 if /pt1/ is
+// left empty.
+static int free_user_pt1(struct pte * pt1, int lo, int hi, uintptr_t base) {
+    const uintptr_t last = USER_END_VMA - 1;
+    uintptr_t mbase;
+    struct pte * pt0;
+    int j, klo, khi;
+
+    for (j = lo; j <= hi; j++) {
+        if (verify_flags(pt1[j].flags) != 0 || (pt1[j].flags & PTE_G))
+            continue;
+
+        // User megapage
+        if (pte_is_leaf(&pt1[j])) {
+            if (pt1[j].flags & PTE_U) {
+                page_unref(pagenum_to_pageptr(pt1[j].ppn));
+                pt1[j] = null_pte();
+                rss_add(active_space_mtag(), -(long)(MEGA_SIZE / PAGE_SIZE));
+            }
+            continue;
+        }
+
+        mbase = base + ((uintptr_t)j << (9+12));
+        klo = (mbase < USER_START_VMA) ? VPN0(USER_START_VMA) : 0;
+        khi = (mbase + MEGA_SIZE - 1 > last) ? VPN0(last) : PTE_CNT - 1;
+
+        pt0 = pagenum_to_pageptr(pt1[j].ppn);
+        if (free_user_pt0(pt0, klo, khi)) {
+            pt1[j] = null_pte();
+            free_ptab(pt0);
+        }
     }
-    if(!(page->flags & (PTE_U))){
-        return -EACCESS;
+
+    return pt_empty(pt1);
+}
+
+// Unmaps and drops the references to the user pages of /pt0/ entries lo..hi.
+// Returns 1 if /pt0/ is left empty.
+static int free_user_pt0(struct pte * pt0, int lo, int hi) {
+    long cnt = 0;
+    int k;
+
+    for (k = lo; k <= hi; k++) {
+        if (pte_swapped(&pt0[k])) {
+            swap_slot_unref(pt0[k].ppn);
+            pt0[k] = null_pte();
+            continue;
+        }
+
+        if (verify_flags(pt0[k].flags) != 0 || !(pt0[k].flags & PTE_U))
+            continue;
+
+        page_unref(pagenum_to_pageptr(pt0[k].ppn));
+        pt0[k] = null_pte();
+        cnt += 1;
     }
-    uintptr_t ppn = (uintptr_t)page->ppn;
-    void* pp = pagenum_to_pageptr(ppn);
-    memory_free_page(pp);
-    *page = null_pte();
-    return 0;
+
+    rss_add(active_space_mtag(), -cnt);
+    return pt_empty(pt0);
 }
 
-struct pte* walk_pt(struct pte* root, uintptr_t vma, int create){
+// Page tables of memory spaces are allocated and freed through these two so
+// that ptab_cnt stays up to date.
+
+static void * alloc_ptab(void) {
+    ptab_cnt += 1;
+    return memory_alloc_page();
+}
+
+static void free_ptab(void * pt) {
+    ptab_cnt -= 1;
+    memory_free_page(pt);
+}
+
+// Adds /cnt/ pages to the resident set size of the process whose memory space
+// is /mtag/. This is usually the current process; the others are looked up in
+// the process table. User pages mapped by the kernel before the process
+// manager is up are not counted.
+
+static void rss_add(uintptr_t mtag, long cnt) {
+    struct process * proc;
+    int pid;
+
+    if (!procmgr_initialized || cnt == 0)
+        return;
+
+    proc = current_process();
+
+    if (proc == NULL || proc->mtag != mtag) {
+        for (pid = 0; pid < NPROC; pid++) {
+            proc = proctab[pid];
+            if (proc != NULL && proc->mtag == mtag)
+                break;
+        }
+
+        if (pid == NPROC)
+            return;
+    }
+
+    proc->rss += cnt;
+}
+
+static inline int pt_empty(const struct pte * pt) {
+    int k;
+
+    for (k = 0; k < PTE_CNT; k++) {
+        if (pt[k].flags & PTE_V)
+            return 0;
+    }
+
+    return 1;
+}
+
+static inline struct frame * pageptr_to_frame(const void * pp) {
+    return &frametab[pageptr_to_framenum(pp)];
+}
+
+static inline uintptr_t pageptr_to_framenum(const void * pp) {
+    const uintptr_t pma = kva_to_pma(pp);
+
+    assert (RAM_START_PMA <= pma && pma < RAM_END_PMA);
+    return (pma - RAM_START_PMA) >> PAGE_ORDER;
+}
+
+static inline void * framenum_to_pageptr(uintptr_t n) {
+    return pma_to_kva(RAM_START_PMA + (n << PAGE_ORDER));
+}
+
+// Free lists are doubly linked through the free blocks themselves so that a
+// buddy can be unlinked from the middle of its list when merging.
+
+static void free_list_push(union linked_page * blk, unsigned int order) {
+    struct frame * const fr = pageptr_to_frame(blk);
+
+    fr->refcnt = 0;
+    fr->order = order;
+    fr->flags = (fr->flags & ~(FRAME_USER | FRAME_OWNED | FRAME_REF)) |
+        FRAME_FREE;
+    free_cnt += 1UL << order;
+
+    blk->prev = NULL;
+    blk->next = free_lists[order];
+    if (blk->next != NULL)
+        blk->next->prev = blk;
+    free_lists[order] = blk;
+}
+
+// Takes a block of 2^order pages off the free lists, splitting a larger block
+// if necessary, or else from RAM that was never handed out. The contents of the
+// block are left as they are. Returns NULL if there is no large enough free
+// block.
+
+static union linked_page * alloc_block(unsigned int order) {
+    union linked_page * blk;
+    struct frame * fr;
+    unsigned int k;
+
+    // Find the smallest free block that is large enough
+
+    for (k = order; k <= PAGE_MAX_ORDER; k++)
+        if (free_lists[k] != NULL)
+            break;
+    
+    if (PAGE_MAX_ORDER < k)
+        return bump_alloc(order);
+
+    blk = free_lists[k];
+    free_list_remove(blk, k);
+
+    // Split it down to the requested size, freeing the upper halves
+
+    while (order < k) {
+        k -= 1;
+        free_list_push((void*)blk + (PAGE_SIZE << k), k);
+    }
+
+    fr = pageptr_to_frame(blk);
+    fr->order = order;
+    fr->refcnt = 1;
+
+    track_free_low();
+    return blk;
+}
+
+// Carves a block of 2^order pages off the never-used RAM at bump_fn. Frames
+// skipped to align the block are put on the free lists. Returns NULL if the
+// rest of RAM is too small.
+
+static union linked_page * bump_alloc(unsigned int order) {
+    const uintptr_t cnt = 1UL << order;
+    uintptr_t n = bump_fn;
+    struct frame * fr;
+    unsigned int k;
+
+    while ((n & (cnt - 1)) != 0) {
+        // Largest block that starts at n and is aligned to its size
+        k = __builtin_ctzl(n);
+        while (NFRAME < n + (1UL << k))
+            k -= 1;
+
+        memset(&frametab[n], 0, sizeof(struct frame) << k);
+        bump_fn = n + (1UL << k);
+        memory_free_pages(framenum_to_pageptr(n), k);
+        n = bump_fn;
+
+        if (n == NFRAME)
+            return NULL;
+    }
+
+    if (NFRAME < n + cnt)
+        return NULL;
+
+    memset(&frametab[n], 0, sizeof(struct frame) << order);
+    bump_fn = n + cnt;
+
+    fr = &frametab[n];
+    fr->order = order;
+    fr->refcnt = 1;
+
+    track_free_low();
+    return framenum_to_pageptr(n);
+}
+
+// Records a new low of free pages, which is a new high of pages in use.
+
+static inline void track_free_low(void) {
+    const size_t cnt = memory_free_page_cnt();
+
+    if (cnt < free_low)
+        free_low = cnt;
+}
+
+static void * zeroed_pool_pop(void) {
+    union linked_page * pp;
+
+    pp = zeroed_pool;
+
+    if (pp == NULL)
+        return NULL;
+    
+    zeroed_pool = pp->next;
+    zeroed_cnt -= 1;
+
+    pp->next = NULL; // restore the zero word used for the link
+    pageptr_to_frame(pp)->refcnt = 1;
+    track_free_low();
+    return pp;
+}
+
+static void zeroed_pool_drain(void) {
+    void * pp;
+
+    while ((pp = zeroed_pool_pop()) != NULL)
+        memory_free_page(pp);
+}
+
+// Clears a page a doubleword at a time (memset works a byte at a time).
+
+static inline void zero_page(void * pp) {
+    uint64_t * p = pp;
+    size_t i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        p[i] = 0;
+}
+
+static void free_list_remove(union linked_page * blk, unsigned int order) {
+    pageptr_to_frame(blk)->flags &= ~FRAME_FREE;
+    free_cnt -= 1UL << order;
+
+    if (blk->prev != NULL)
+        blk->prev->next = blk->next;
+    else
+        free_lists[order] = blk->next;
+    
+    if (blk->next != NULL)
+        blk->next->prev = blk->prev;
+}
+
+static inline void page_ref(void * pp) {
+    struct frame * const fr = pageptr_to_frame(pp);
+
+    if (pp == shared_zero_page)
+        return;
+
+    // A shared page has no single owner to swap it out from
+    fr->refcnt += 1;
+
+    if (fr->flags & FRAME_USER)
+        fr->flags = (fr->flags & ~FRAME_USER) | FRAME_OWNED;
+}
+
+// Drops a reference to a page, held by the active memory space, and frees the
+// page when the last reference is gone. If the owner of a shared page is the
+// last one left, it owns the page again. If the owner goes first, the page
+// has none until memory_space_sample finds the one that is left.
+
+static inline void page_unref(void * pp) {
+    struct frame * const fr = pageptr_to_frame(pp);
+
+    if (pp == shared_zero_page)
+        return;
+
+    assert (fr->refcnt != 0);
+
+    if (fr->root == pageptr_to_pagenum(active_space_root()))
+        fr->flags &= ~FRAME_OWNED;
+
+    fr->flags &= ~FRAME_USER;
+    
+    if (--fr->refcnt == 0)
+        memory_free_pages(pp, fr->order);
+    else if (fr->refcnt == 1 && (fr->flags & FRAME_OWNED))
+        fr->flags = (fr->flags & ~FRAME_OWNED) | FRAME_USER;
+}
+
+// Resolves a store to a COW page. If the page is still shared, the faulting
+// memory space gets its own copy; otherwise the last sharer simply gets write
+// permission back. The shared zero page is replaced by a fresh zeroed page.
+
+static void cow_break(struct pte * pte, uintptr_t vma) {
+    void * const old_pp = pagenum_to_pageptr(pte->ppn);
+    void * new_pp;
+
+    if (old_pp == shared_zero_page) {
+        pte->ppn = pageptr_to_pagenum(memory_alloc_page());
+    } else if (pageptr_to_frame(old_pp)->refcnt > 1) {
+        new_pp = memory_alloc_page_unzeroed();
+        memcpy(new_pp, old_pp, PAGE_SIZE);
+        page_unref(old_pp);
+        pte->ppn = pageptr_to_pagenum(new_pp);
+    }
+
+    frame_set_owner(pagenum_to_pageptr(pte->ppn), vma);
+    pte->rsw &= ~PTE_RSW_COW;
+    pte->flags |= PTE_W | PTE_D;
+    sfence_vma_asid(active_space_asid());
+}
+
+// Like cow_break, for a megapage leaf. The copy goes into a new megapage if
+// a block is free and into private pages otherwise.
+
+static void mega_cow_break(struct pte * pte, uintptr_t vma) {
+    void * const old_blk = pagenum_to_pageptr(pte->ppn);
+    void * new_blk;
+
+    if (pageptr_to_frame(old_blk)->refcnt > 1) {
+        new_blk = alloc_block(MEGA_ORDER);
+        if (new_blk == NULL) {
+            split_megapage(pte, vma);
+            return;
+        }
+        memcpy(new_blk, old_blk, MEGA_SIZE);
+        page_unref(old_blk);
+        pte->ppn = pageptr_to_pagenum(new_blk);
+    }
+
+    pte->rsw &= ~PTE_RSW_COW;
+    pte->flags |= PTE_W | PTE_D;
+    sfence_vma_asid(active_space_asid());
+}
+
+// Maps the physical page /pp/ at /vma/ in the memory space with root /root/.
+
+static void map_page(struct pte * root, uintptr_t vma, void * pp, uint_fast8_t rwxug_flags) {
+    struct pte * const pt0 = walk_pt0(root, vma, 1);
+
+    set_user_leaf(&pt0[VPN0(vma)], vma, pp, rwxug_flags);
+    sfence_vma_range(vma, PAGE_SIZE);
+}
+
+// Points the level-0 leaf /pte/ for /vma/ at the physical page /pp/ without
+// flushing the TLB. The shared zero page is mapped read-only, and also
+// copy-on-write if /rwxug_flags/ allow writes; any other page becomes a
+// private page of the active memory space.
+
+static void set_user_leaf(struct pte * pte, uintptr_t vma, void * pp, uint_fast8_t rwxug_flags) {
+    if (pp == shared_zero_page) {
+        *pte = leaf_pte(pp, rwxug_flags & ~PTE_W);
+        if (rwxug_flags & PTE_W)
+            pte->rsw = PTE_RSW_COW;
+    } else {
+        *pte = leaf_pte(pp, rwxug_flags);
+        frame_set_owner(pp, vma);
+    }
+
+    rss_add(active_space_mtag(), 1);
+}
+
+// Returns the demand-paged region of the current process containing /vma/,
+// or NULL if there is none.
+
+static struct mem_region * find_region(uintptr_t vma) {
+    struct process * const proc = current_process();
+    int i;
+
+    if (proc == NULL)
+        return NULL;
+
+    for (i = 0; i < MEMORY_REGION_MAX; i++) {
+        if (proc->regions[i].start <= vma && vma < proc->regions[i].end)
+            return &proc->regions[i];
+    }
+
+    return NULL;
+}
+
+// Maps the page at /vma/ if it belongs to a demand-paged region, filling it
+// from the backing file. Returns 1 if the page was mapped and 0 if /vma/ is
+// not in any region. Terminates the process if the file cannot be read.
+
+static int region_map_page(uintptr_t vma, uint_fast8_t access) {
+    struct mem_region * const rgn = find_region(vma);
+
+    if (rgn == NULL)
+        return 0;
+
+    map_page(active_space_root(), vma, region_fill_page(rgn, vma, access, 1), rgn->flags);
+    return 1;
+}
+
+// Returns the physical page to map at /vma/ in region /rgn/: the shared zero
+// page for a read of a page with no file contents (BSS), or else a new page
+// filled from the backing file. If /may_swap/ is zero, returns NULL instead of
+// swapping out a page to make room. Terminates the process if the file cannot
+// be read.
+
+static void * region_fill_page (
+    struct mem_region * rgn, uintptr_t vma, uint_fast8_t access, int may_swap)
+{
+    uintptr_t lo, hi;
+    uint64_t pos;
+    long cnt = 0;
+    void * pp;
+
+    lo = (vma < rgn->file_vma) ? rgn->file_vma : vma;
+    hi = MIN(vma + PAGE_SIZE, rgn->file_vma + rgn->file_len);
+
+    if ((rgn->io == NULL || hi <= lo) && access != PTE_W)
+        return shared_zero_page;
+
+    // The page is filled through the direct map before it is mapped, so the
+    // region's own flags do not need to allow writes.
+
+    pp = may_swap ? memory_alloc_page() : try_alloc_page();
+
+    if (pp == NULL)
+        return NULL;
+
+    if (rgn->io != NULL && lo < hi) {
+        lock_acquire(&pager_lock);
+        ioctl(rgn->io, IOCTL_GETPOS, &pos);
+        cnt = ioseek(rgn->io, rgn->file_off + (lo - rgn->file_vma));
+        if (cnt == 0)
+            cnt = ioread_full(rgn->io, pp + (lo - vma), hi - lo);
+        ioseek(rgn->io, pos);
+        lock_release(&pager_lock);
+
+        if (cnt != hi - lo) {
+            memory_free_page(pp);
+            kprintf("Page-in failed at %p\n", (void *)vma);
+            process_exit();
+        }
+    }
+
+    return pp;
+}
+
+// Returns the level-1 page table that maps /vma/, or NULL if there is none
+// and /create/ is zero. Otherwise a missing table is allocated.
+static struct pte * walk_pt1(struct pte * root, uintptr_t vma, int create) {
     struct pte* pt2 = root;
 
     uintptr_t pt1_ppn = pt2[VPN2(vma)].ppn;
@@ -678,28 +2153,219 @@ struct pte* walk_pt(struct pte* root, uintptr_t vma, int create){
         if(!create){
             return NULL;
         }
-        void * pt1_pma = memory_alloc_page();
-        memset(pt1_pma, 0, PAGE_SIZE);
+        void * pt1_pma = alloc_ptab();
         pt2[VPN2(vma)] = ptab_pte(pt1_pma, 0);
         pt1_ppn = pt2[VPN2(vma)].ppn;
     }
 
-    struct pte* pt1 = (struct pte*)pagenum_to_pageptr(pt1_ppn);
+    return (struct pte*)pagenum_to_pageptr(pt1_ppn);
+}
+
+// Returns the level-0 page table that maps /vma/, or NULL if there is none
+// and /create/ is zero. Otherwise missing tables are allocated, and a user
+// megapage covering /vma/ is split into pages.
+static struct pte * walk_pt0(struct pte * root, uintptr_t vma, int create) {
+    struct pte* pt1 = walk_pt1(root, vma, create);
+
+    if(pt1 == NULL){
+        return NULL;
+    }
 
     uintptr_t pt0_ppn = pt1[VPN1(vma)].ppn;
     uint64_t pt0_flags = pt1[VPN1(vma)].flags;
-    // Check if root PTE refers to gigapage - if so, create a new page table for it
+
+    if(verify_flags(pt0_flags) == 0 && (pt0_flags & PTE_U) != 0 &&
+        pte_is_leaf(&pt1[VPN1(vma)]))
+    {
+        return create ? split_megapage(&pt1[VPN1(vma)], vma) : NULL;
+    }
+
+    // Check if PTE refers to megapage - if so, create a new page table for it
     if((pt0_flags & (PTE_R | PTE_W | PTE_X)) != 0 || verify_flags(pt0_flags) != 0){
         if(!create){
             return NULL;
         }
-        void * pt0_pma = memory_alloc_page();
-        memset(pt0_pma, 0, PAGE_SIZE);
+        void * pt0_pma = alloc_ptab();
         pt1[VPN1(vma)] = ptab_pte(pt0_pma, 0);
         pt0_ppn = pt1[VPN1(vma)].ppn;
     }
 
-    struct pte* pt0 = (struct pte*)pagenum_to_pageptr(pt0_ppn);
+    return (struct pte*)pagenum_to_pageptr(pt0_ppn);
+}
+
+// Returns the leaf PTE that maps /vma/, at whichever level it is, and stores
+// the size of the page it maps in *szptr. Returns NULL if /vma/ is unmapped.
+static struct pte * find_leaf(struct pte * root, uintptr_t vma, size_t * szptr) {
+    struct pte * pt;
+
+    pt = &root[VPN2(vma)];
+    *szptr = GIGA_SIZE;
+    if (verify_flags(pt->flags) != 0)
+        return NULL;
+    if (pte_is_leaf(pt))
+        return pt;
+
+    pt = (struct pte *)pagenum_to_pageptr(pt->ppn) + VPN1(vma);
+    *szptr = MEGA_SIZE;
+    if (verify_flags(pt->flags) != 0)
+        return NULL;
+    if (pte_is_leaf(pt))
+        return pt;
+
+    pt = (struct pte *)pagenum_to_pageptr(pt->ppn) + VPN0(vma);
+    *szptr = PAGE_SIZE;
+    if (verify_flags(pt->flags) != 0)
+        return NULL;
+    return pt;
+}
+
+static inline int pte_is_leaf(const struct pte * pte) {
+    return (pte->flags & (PTE_R | PTE_W | PTE_X)) != 0;
+}
+
+// Replaces the R, W, X, U and G flags of a valid leaf PTE. A shared COW page
+// stays read-only until it is copied. If the new flags do not allow writes,
+// it never will be.
+static void set_leaf_flags(struct pte * pte, uint_fast8_t rwxug_flags) {
+    if (pagenum_to_pageptr(pte->ppn) == shared_zero_page &&
+        (rwxug_flags & PTE_W))
+    {
+        rwxug_flags &= ~PTE_W;
+        pte->rsw |= PTE_RSW_COW;
+    } else if (pte->rsw & PTE_RSW_COW) {
+        if (rwxug_flags & PTE_W)
+            rwxug_flags &= ~PTE_W;
+        else
+            pte->rsw &= ~PTE_RSW_COW;
+    }
+
+    pte->flags = (pte->flags & (PTE_V | PTE_A | PTE_D)) |
+        (rwxug_flags & (PTE_R | PTE_W | PTE_X | PTE_U | PTE_G));
+}
+
+// Maps the 2 MB region at /vma/ with a single level-1 leaf PTE. If the region
+// is already a megapage, only its flags are updated. Returns 0 without
+// changing anything if part of the region is mapped by pages or if there is
+// no free physically contiguous block.
+static int map_megapage(struct pte * root, uintptr_t vma, uint_fast8_t rwxug_flags) {
+    struct pte * const pt1 = walk_pt1(root, vma, 1);
+    struct pte * const pte = &pt1[VPN1(vma)];
+    void * blk;
+    int k;
+
+    if (verify_flags(pte->flags) == 0) {
+        if (!pte_is_leaf(pte))
+            return 0;
+        set_leaf_flags(pte, rwxug_flags);
+        return 1;
+    }
+
+    blk = alloc_block(MEGA_ORDER);
+
+    if (blk == NULL)
+        return 0;
+
+    for (k = 0; k < PTE_CNT; k++)
+        zero_page(blk + k * PAGE_SIZE);
+
+    *pte = leaf_pte(blk, rwxug_flags);
+
+    if (rwxug_flags & PTE_U)
+        rss_add(active_space_mtag(), MEGA_SIZE / PAGE_SIZE);
+
+    return 1;
+}
+
+// Replaces the user megapage leaf /pt1e/ by a level-0 table mapping the same
+// memory with pages, and returns the new table. A private block is split in
+// place into order-0 frames. A block still shared with another memory space
+// is copied into private pages instead.
+static struct pte * split_megapage(struct pte * pt1e, uintptr_t vma) {
+    const uintptr_t base = round_down_addr(vma, MEGA_SIZE);
+    void * const blk = pagenum_to_pageptr(pt1e->ppn);
+    struct frame * const fr = pageptr_to_frame(blk);
+    const struct pte leaf = *pt1e;
+    struct pte * pt0;
+    void * pp;
+    int k;
+
+    pt0 = alloc_ptab();
+
+    if (fr->refcnt == 1) {
+        for (k = 0; k < PTE_CNT; k++) {
+            fr[k].order = 0;
+            fr[k].refcnt = 1;
+            frame_set_owner(blk + k * PAGE_SIZE, base + k * PAGE_SIZE);
+            pt0[k] = leaf;
+            pt0[k].ppn = leaf.ppn + k;
+        }
+    } else {
+        for (k = 0; k < PTE_CNT; k++) {
+            pp = memory_alloc_page_unzeroed();
+            memcpy(pp, blk + k * PAGE_SIZE, PAGE_SIZE);
+            frame_set_owner(pp, base + k * PAGE_SIZE);
+            pt0[k] = leaf;
+            pt0[k].ppn = pageptr_to_pagenum(pp);
+            if (leaf.rsw & PTE_RSW_COW) {
+                pt0[k].rsw &= ~PTE_RSW_COW;
+                pt0[k].flags |= PTE_W | PTE_D;
+            }
+        }
+        page_unref(blk);
+    }
+
+    *pt1e = ptab_pte(pt0, 0);
+    sfence_vma_asid(active_space_asid());
+    return pt0;
+}
+
+// Replaces the level-0 table covering /vma/ by a megapage if every one of its
+// entries maps a private user page with the same flags. Does nothing if no
+// physically contiguous block is free.
+static void promote_megapage(struct pte * root, uintptr_t vma) {
+    struct pte * const pt1 = walk_pt1(root, vma, 0);
+    struct pte * pt0;
+    void * blk;
+    void * pp;
+    int k;
+
+    if (pt1 == NULL || verify_flags(pt1[VPN1(vma)].flags) != 0 ||
+        pte_is_leaf(&pt1[VPN1(vma)]))
+        return;
+
+    pt0 = pagenum_to_pageptr(pt1[VPN1(vma)].ppn);
+
+    for (k = 0; k < PTE_CNT; k++) {
+        if (verify_flags(pt0[k].flags) != 0 ||
+            (pt0[k].flags & (PTE_U | PTE_G)) != PTE_U ||
+            ((pt0[k].flags ^ pt0[0].flags) & ~(PTE_A | PTE_D)) != 0 ||
+            pt0[k].rsw != 0 ||
+            pageptr_to_frame(pagenum_to_pageptr(pt0[k].ppn))->refcnt != 1)
+            return;
+    }
+
+    blk = alloc_block(MEGA_ORDER);
+
+    if (blk == NULL)
+        return;
+
+    for (k = 0; k < PTE_CNT; k++) {
+        pp = pagenum_to_pageptr(pt0[k].ppn);
+        memcpy(blk + k * PAGE_SIZE, pp, PAGE_SIZE);
+        page_unref(pp);
+    }
+
+    pt1[VPN1(vma)] = leaf_pte(blk, pt0[0].flags & ~(PTE_V | PTE_A | PTE_D));
+    free_ptab(pt0);
+    sfence_vma_asid(active_space_asid());
+}
+
+struct pte* walk_pt(struct pte* root, uintptr_t vma, int create){
+    struct pte* pt0 = walk_pt0(root, vma, create);
+
+    if(pt0 == NULL){
+        return NULL;
+    }
 
     uintptr_t flags = pt0[VPN0(vma)].flags;
 
@@ -708,11 +2374,406 @@ struct pte* walk_pt(struct pte* root, uintptr_t vma, int create){
             return NULL;
         }
         void * pma = memory_alloc_page();
-        memset(pma, 0, PAGE_SIZE);
         pt0[VPN0(vma)] = leaf_pte(pma, PTE_R);
     }
 
     // kprintf("walked vma: %x, found ppn %lx\n", vma, pt0[VPN0(vma)].ppn);
 
     return &(pt0[VPN0(vma)]);
-}
\ No newline at end of file
+}
+// Records that the private user page /pp/ is mapped at /vma/ in the active
+// memory space, making it a candidate for swapping out.
+
+static inline void frame_set_owner(void * pp, uintptr_t vma) {
+    struct frame * const fr = pageptr_to_frame(pp);
+
+    fr->flags |= FRAME_USER;
+    fr->upn = (vma - USER_START_VMA) >> PAGE_ORDER;
+    fr->asid = active_space_asid();
+    fr->root = pageptr_to_pagenum(active_space_root());
+}
+
+// Adds the user leaf /pte/, which maps /cnt/ pages, to the sample /smp/ and
+// clears its accessed and dirty bits. The swap clock (swap_out_page) also
+// uses the accessed bit, so it is kept for it in the frame as FRAME_REF.
+
+static void sample_leaf(struct pte * pte, size_t cnt, struct memory_sample * smp) {
+    if ((pte->flags & (PTE_U | PTE_G)) != PTE_U)
+        return;
+    
+    smp->resident += cnt;
+
+    if (pte->flags & PTE_A) {
+        smp->accessed += cnt;
+        pageptr_to_frame(pagenum_to_pageptr(pte->ppn))->flags |= FRAME_REF;
+    }
+
+    if (pte->flags & PTE_D)
+        smp->dirtied += cnt;
+    
+    pte->flags &= ~(PTE_A | PTE_D);
+}
+
+// Makes the memory space /mtag/ the owner of the user page that /pte/ maps
+// at /vma/ in it, if the page lost its owner while it was shared and /pte/ is
+// now its only mapping (see page_unref).
+
+static void frame_claim(const struct pte * pte, uintptr_t vma, uintptr_t mtag) {
+    void * const pp = pagenum_to_pageptr(pte->ppn);
+    struct frame * const fr = pageptr_to_frame(pp);
+
+    if ((pte->flags & (PTE_U | PTE_G)) != PTE_U || pp == shared_zero_page ||
+        fr->refcnt != 1 || (fr->flags & (FRAME_USER | FRAME_OWNED)) != 0)
+        return;
+
+    fr->flags |= FRAME_USER;
+    fr->upn = (vma - USER_START_VMA) >> PAGE_ORDER;
+    fr->asid = MTAG_ASID(mtag);
+    fr->root = pageptr_to_pagenum(mtag_to_root(mtag));
+}
+
+// Returns the mtag of the memory space that owns the FRAME_USER page /fr/.
+
+static inline uintptr_t frame_owner_mtag(const struct frame * fr) {
+    return ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) |
+        ((uintptr_t)fr->asid << RISCV_SATP_ASID_shift) | fr->root;
+}
+
+static inline int pte_swapped(const struct pte * pte) {
+    return (pte->flags & PTE_V) == 0 && (pte->rsw & PTE_RSW_SWAP) != 0;
+}
+
+// Returns a free swap slot with its reference count set to 1, or -1 if the
+// swap device is full.
+
+static int swap_slot_alloc(void) {
+    size_t n;
+
+    for (n = 0; n < swap_nslot; n++) {
+        if (swap_refcnt[n] == 0) {
+            swap_refcnt[n] = 1;
+            swap_used += 1;
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+static void swap_slot_unref(uintptr_t slot) {
+    assert (slot < swap_nslot && swap_refcnt[slot] != 0);
+    if (--swap_refcnt[slot] == 0)
+        swap_used -= 1;
+}
+
+// Writes one private user page to swap and frees its frame. Victims are chosen
+// with the clock algorithm: a page whose accessed bit is set gets the bit
+// cleared and a second chance. Returns 1 if a frame was freed and 0 if there
+// is no swap device, no free slot or nothing that can be swapped out.
+
+static int swap_out_page(void) {
+    struct frame * fr;
+    struct pte * pt0;
+    struct pte * pte;
+    uintptr_t vma, asid;
+    size_t scanned;
+    long cnt;
+    int slot;
+    void * pp;
+
+    // Give up if called while this thread is already moving a page; the
+    // allocation came from the swap I/O path itself.
+
+    if (swap_io == NULL || swap_lock.tid == running_thread())
+        return 0;
+
+    lock_acquire(&swap_lock);
+
+    for (scanned = 0; scanned < 2 * bump_fn; scanned++) {
+        fr = &frametab[clock_hand];
+        pp = framenum_to_pageptr(clock_hand);
+        clock_hand = (clock_hand + 1) % bump_fn;
+
+        if ((fr->flags & (FRAME_USER | FRAME_FREE)) != FRAME_USER ||
+            fr->refcnt != 1 || fr->order != 0)
+            continue;
+
+        vma = USER_START_VMA + ((uintptr_t)fr->upn << PAGE_ORDER);
+        asid = fr->asid;
+        pt0 = walk_pt0(mtag_to_root(frame_owner_mtag(fr)), vma, 0);
+
+        if (pt0 == NULL)
+            continue;
+
+        pte = &pt0[VPN0(vma)];
+
+        if (verify_flags(pte->flags) != 0 ||
+            pte->ppn != pageptr_to_pagenum(pp))
+            continue;
+
+        // Second chance for a page accessed since the hand last passed it,
+        // as seen by either the accessed bit or memory_space_sample
+
+        if ((pte->flags & PTE_A) || (fr->flags & FRAME_REF)) {
+            pte->flags &= ~PTE_A;
+            fr->flags &= ~FRAME_REF;
+            asm inline ("sfence.vma %0, %1" :: "r" (vma), "r" (asid) : "memory");
+            continue;
+        }
+
+        slot = swap_slot_alloc();
+
+        if (slot < 0)
+            break;
+
+        // Unmap the page before writing it out. An access in the meantime
+        // faults and waits for swap_lock in swap_in_page.
+
+        pte->flags &= ~PTE_V;
+        pte->rsw |= PTE_RSW_SWAP;
+        pte->ppn = slot;
+        fr->flags &= ~FRAME_USER;
+        rss_add(frame_owner_mtag(fr), -1);
+        asm inline ("sfence.vma %0, %1" :: "r" (vma), "r" (asid) : "memory");
+
+        // The owner may be running in user mode on another hart
+
+        smp_tlb_shootdown();
+
+        cnt = ioseek(swap_io, (uint64_t)slot * PAGE_SIZE);
+        if (cnt == 0)
+            cnt = iowrite(swap_io, pp, PAGE_SIZE);
+        if (cnt != PAGE_SIZE)
+            panic("swap write failed");
+
+        memory_free_page(pp);
+        lock_release(&swap_lock);
+        return 1;
+    }
+
+    lock_release(&swap_lock);
+    return 0;
+}
+
+// Makes at least one physical page free by shrinking the balloon or, failing
+// that, by swapping out a user page. Returns 0 if neither is possible.
+
+static int reclaim_page(void) {
+    if (balloon_deflate != NULL && balloon_deflate(BALLOON_DEFLATE_CNT) != 0)
+        return 1;
+    
+    return swap_out_page();
+}
+
+// Reads the page at /vma/ back from swap if it is swapped out. Returns 1 if
+// the page is mapped on return and 0 if it was not swapped out.
+
+static int swap_in_page(uintptr_t vma) {
+    struct pte * const root = active_space_root();
+    struct pte * pt0;
+    struct pte * pte;
+    uintptr_t slot;
+    long cnt;
+    void * pp;
+
+    pt0 = walk_pt0(root, vma, 0);
+
+    if (pt0 == NULL || !pte_swapped(&pt0[VPN0(vma)]))
+        return 0;
+
+    // Get the frame before taking swap_lock, since getting it may itself
+    // need to swap a page out.
+
+    pp = memory_alloc_page_unzeroed();
+
+    lock_acquire(&swap_lock);
+
+    pt0 = walk_pt0(root, vma, 0);
+    pte = (pt0 != NULL) ? &pt0[VPN0(vma)] : NULL;
+
+    if (pte == NULL || !pte_swapped(pte)) {
+        lock_release(&swap_lock);
+        memory_free_page(pp);
+        return (pte != NULL && verify_flags(pte->flags) == 0);
+    }
+
+    slot = pte->ppn;
+    cnt = ioseek(swap_io, (uint64_t)slot * PAGE_SIZE);
+    if (cnt == 0)
+        cnt = ioread_full(swap_io, pp, PAGE_SIZE);
+    if (cnt != PAGE_SIZE)
+        panic("swap read failed");
+
+    swap_slot_unref(slot);
+    pte->ppn = pageptr_to_pagenum(pp);
+    pte->rsw &= ~PTE_RSW_SWAP;
+    pte->flags |= PTE_V | PTE_A | PTE_D;
+    frame_set_owner(pp, vma);
+    rss_add(active_space_mtag(), 1);
+
+    lock_release(&swap_lock);
+    sfence_vma_range(vma, PAGE_SIZE);
+    return 1;
+}
+
+// Maps a page that is swapped out or belongs to a demand-paged region.
+// /access/ is PTE_R, PTE_W or PTE_X, the kind of access that needs the page.
+// Returns 1 if /vma/ is mapped on return.
+
+static int fault_in(uintptr_t vma, uint_fast8_t access) {
+    return swap_in_page(vma) || region_map_page(vma, access);
+}
+
+// Maps an anonymous user read/write page at /vma/ in the active memory space:
+// the shared zero page for a read and a new zeroed page otherwise.
+
+static void map_anon_page(uintptr_t vma, uint_fast8_t access) {
+    if (access == PTE_R)
+        map_page(active_space_root(), vma, shared_zero_page, PTE_U | PTE_R | PTE_W);
+    else
+        memory_alloc_and_map_page(vma, PTE_U | PTE_R | PTE_W);
+}
+
+// Returns a direct-mapped pointer to the byte at user address /vma/ after
+// making sure that its page is mapped with at least /rwxug_flags/. Resolves
+// the page the same way memory_handle_page_fault would: by swapping or paging
+// it in, by mapping a new page, or by breaking copy-on-write sharing for a
+// write. Returns NULL if the address is outside the user window or the
+// access is not allowed.
+
+static void * user_page_ptr(uintptr_t vma, uint_fast8_t rwxug_flags) {
+    struct pte * const root = active_space_root();
+    const uintptr_t page = round_down_addr(vma, PAGE_SIZE);
+    const uint_fast8_t access = (rwxug_flags & PTE_W) ? PTE_W : PTE_R;
+    struct pte * pte;
+    size_t size;
+
+    if (vma < USER_START_VMA || USER_END_VMA <= vma)
+        return NULL;
+
+    pte = find_leaf(root, vma, &size);
+
+    if (pte == NULL) {
+        if (!fault_in(page, access))
+            map_anon_page(page, access);
+        pte = find_leaf(root, vma, &size);
+    }
+
+    if (pte != NULL && (rwxug_flags & PTE_W) && !(pte->flags & PTE_W) &&
+        (pte->rsw & PTE_RSW_COW))
+    {
+        if (size == MEGA_SIZE)
+            mega_cow_break(pte, vma);
+        else
+            cow_break(pte, vma);
+        pte = find_leaf(root, vma, &size);
+    }
+
+    if (pte == NULL || verify_flags(pte->flags) != 0 ||
+        (pte->flags & rwxug_flags) != rwxug_flags)
+        return NULL;
+
+    // The access goes through the direct map, so set A and D here
+
+    pte->flags |= PTE_A;
+    if (rwxug_flags & PTE_W)
+        pte->flags |= PTE_D;
+    return pagenum_to_pageptr(pte->ppn) + (vma & (size - 1));
+}
+
+// Maps the user page at /vma/ for an access of kind /access/ together with up
+// to FAULT_AROUND_* - 1 unmapped neighbours, so that memory touched in order
+// takes one fault per window rather than one per page. The window runs
+// downward for the stack and upward for heap and region pages, and stops at
+// the end of the level-0 table of /vma/, so the table is walked once and the
+// TLB is flushed once. Neighbours only get pages that are free without
+// swapping anything out.
+
+static void fault_around(uintptr_t vma, uint_fast8_t access) {
+    struct mem_region * const rgn = find_region(vma);
+    const uintptr_t tbl = round_down_addr(vma, MEGA_SIZE);
+    uint_fast8_t flags = PTE_U | PTE_R | PTE_W;
+    uintptr_t lo, hi, va;
+    struct pte * pt0;
+    struct pte * pte;
+    void * pp;
+
+    if (rgn != NULL) {
+        lo = vma;
+        hi = MIN(vma + FAULT_AROUND_FILE * PAGE_SIZE, rgn->end);
+        flags = rgn->flags;
+    } else if (USER_MMAP_END_VMA <= vma) {
+        // Anonymous pages above the mmap area are the stack
+        lo = vma - (FAULT_AROUND_STACK - 1) * PAGE_SIZE;
+        if (lo < USER_MMAP_END_VMA)
+            lo = USER_MMAP_END_VMA;
+        hi = vma + PAGE_SIZE;
+    } else {
+        lo = vma;
+        hi = vma + FAULT_AROUND_HEAP * PAGE_SIZE;
+    }
+
+    if (lo < tbl)
+        lo = tbl;
+    if (tbl + MEGA_SIZE < hi)
+        hi = tbl + MEGA_SIZE;
+
+    pt0 = walk_pt0(active_space_root(), vma, 1);
+
+    for (va = lo; va < hi; va += PAGE_SIZE) {
+        pte = &pt0[VPN0(va)];
+
+        if (va == vma) {
+            if (rgn != NULL)
+                pp = region_fill_page(rgn, va, access, 1);
+            else if (access == PTE_R)
+                pp = shared_zero_page;
+            else
+                pp = memory_alloc_page();
+        } else {
+            // Skip pages that are mapped or swapped out, and anonymous
+            // neighbours that belong to a region
+            if (verify_flags(pte->flags) == 0 || pte_swapped(pte) ||
+                find_region(va) != rgn)
+                continue;
+
+            if (rgn != NULL)
+                pp = region_fill_page(rgn, va, access, 0);
+            else if (access == PTE_R)
+                pp = shared_zero_page;
+            else
+                pp = try_alloc_page();
+
+            if (pp == NULL)
+                continue;
+        }
+
+        set_user_leaf(pte, va, pp, flags);
+
+        // Only the faulting page is known to be in use
+        if (va == vma) {
+            pte->flags |= PTE_A;
+            if (access == PTE_W && (pte->flags & PTE_W))
+                pte->flags |= PTE_D;
+        }
+    }
+
+    sfence_vma_range(lo, hi - lo);
+}
+
+// Allocates a zeroed physical page if one is free. Unlike memory_alloc_page,
+// returns NULL rather than swapping out a page to make room.
+
+static void * try_alloc_page(void) {
+    void * pp;
+
+    pp = zeroed_pool_pop();
+
+    if (pp == NULL) {
+        pp = alloc_block(0);
+        if (pp != NULL)
+            zero_page(pp);
+    }
+
+    return pp;
+}
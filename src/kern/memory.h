@@ -5,6 +5,7 @@
 #define _MEMORY_H_
 
 #include "csr.h"
+#include "config.h" // NHART, RAM_HIGH_PMA
 
 #include <stddef.h> // size_t
 #include <stdint.h> // uint_fast32_t
@@ -33,6 +34,31 @@
 #define HEAP_INIT_MIN 256
 #endif
 
+// Largest block the page allocator hands out is 2^PAGE_MAX_ORDER pages.
+
+#ifndef PAGE_MAX_ORDER
+#define PAGE_MAX_ORDER 10
+#endif
+
+// Number of zeroed pages the idle thread keeps ready for memory_alloc_page.
+
+#ifndef ZERO_POOL_MAX
+#define ZERO_POOL_MAX 32
+#endif
+
+// Maximum number of demand-paged regions per process.
+
+#ifndef MEMORY_REGION_MAX
+#define MEMORY_REGION_MAX 8
+#endif
+
+// Maximum number of address space identifiers handed out to memory spaces,
+// including ASID 0. The hart may support fewer.
+
+#ifndef NASID
+#define NASID 64
+#endif
+
 // CONSTANT DEFINITIONS
 //
 
@@ -41,14 +67,63 @@
 
 #define PTE_CNT (PAGE_SIZE/8) // number of PTEs per page table
 
+#define MTAG_ASID_MASK ((1UL << RISCV_SATP_ASID_nbits) - 1)
+#define MTAG_ASID(mtag) (((mtag) >> RISCV_SATP_ASID_shift) & MTAG_ASID_MASK)
+
 // EXPORTED TYPE DEFINITIONS
 //
 
+struct io_intf; // io.h
+
+// Result of memory_space_sample, in pages
+
+struct memory_sample {
+    size_t resident; // mapped user pages
+    size_t accessed; // pages accessed since the previous sample
+    size_t dirtied; // pages written since the previous sample
+};
+
+// Result of memory_get_stats. Sizes are in pages and fault counts are totals
+// over all processes since boot.
+
+struct memory_stats {
+    size_t total; // pages managed by the page allocator
+    size_t free; // pages that can be allocated without reclaiming any
+    size_t zeroed; // free pages that are already zeroed
+    size_t peak; // most pages ever in use at once
+    size_t ptab; // page table pages allocated for memory spaces
+    size_t swap_total; // swap slots
+    size_t swap_used; // swap slots holding a page
+    size_t minflt; // page faults resolved without I/O
+    size_t majflt; // page faults that read from swap or a file
+};
+
+// A range of the user window whose pages are mapped on first access rather
+// than up front. Each page is filled with the bytes of the backing file that
+// fall inside [file_vma, file_vma+file_len), read from file offset file_off
+// onwards, and zero elsewhere. A slot with start == end is unused.
+
+struct mem_region {
+    uintptr_t start; // page aligned
+    uintptr_t end; // page aligned
+    uint_fast8_t flags; // rwxug flags the pages are mapped with
+    struct io_intf * io; // backing file or NULL
+    uintptr_t file_vma;
+    uint64_t file_off;
+    size_t file_len;
+};
+
 // EXPORTED VARIABLE DECLARATIONS
 //
 
 extern uintptr_t main_mtag;
 
+// The ASID 0 memory space whose translations may be in the TLB of each hart.
+// Several memory spaces can share ASID 0, so switching to a different one has
+// to flush it.
+
+extern uintptr_t asid0_mtag[NHART];
+
 // EXPORTED FUNCTION DECLARATIONS
 //
 
@@ -59,6 +134,12 @@ extern uintptr_t main_mtag;
 extern void memory_init(void);
 extern char memory_initialized;
 
+// void memory_init_hart(void)
+// Enables paging in the main memory space on a hart other than hart 0. Must be
+// called on the hart after memory_init has run on hart 0.
+
+extern void memory_init_hart(void);
+
 // uintptr_t memory_space_create(void)
 // Creates a new memory space and makes it the currently active space. Returns a
 // memory space tag (type uintptr_t) that may be used to refer to the memory
@@ -76,6 +157,20 @@ extern uintptr_t memory_space_create(uint_fast16_t asid);
 
 extern void memory_space_reclaim(void);
 
+// void memory_space_flush(uintptr_t mtag)
+// Drops the TLB entries this hart holds for the user mappings of memory space
+// /mtag/. Used when a memory space that was last active on another hart, where
+// its mappings may have changed, becomes active on this one.
+
+extern void memory_space_flush(uintptr_t mtag);
+
+// uint_fast16_t memory_asid_alloc(void)
+// Allocates an address space identifier to pass to memory_space_create or
+// memory_space_clone. Returns 0 when no other ASID is free. The ASID is
+// released by memory_space_reclaim.
+
+extern uint_fast16_t memory_asid_alloc(void);
+
 // uintptr_t active_memory_space(void)
 // Returns the memory space tag of the current memory space.
 
@@ -83,27 +178,116 @@ static inline uintptr_t active_memory_space(void);
 
 // uintptr_t memory_space_switch(uintptr_t mtag)
 // Switches to another memory space and returns the memory space tag of the
-// previously active memory space.
+// previously active memory space. Does nothing if /mtag/ is already active.
+// The TLB is only flushed when entering an ASID 0 space that was not the last
+// one loaded.
 
 static inline uintptr_t memory_space_switch(uintptr_t mtag);
 
 // uintptr_t memory_space_clone(uint_fast16_t asid)
 // Clones the memory space of the currently running process and returns the
-// memory space tag of the new memory space.
+// memory space tag of the new memory space. User pages are shared between the
+// two spaces; writable pages become copy-on-write in both of them.
 extern uintptr_t memory_space_clone(uint_fast16_t asid);
 
+// uintptr_t kva_to_pma(const volatile void * kp)
+// void * pma_to_kva(uintptr_t pma)
+// Convert between the kernel address and the physical address of RAM, e.g.,
+// for an address handed to a device. RAM below RAM_HIGH_PMA is identity-mapped
+// and the rest is mapped at RAM_HIGH_VMA (see config.h).
+
+static inline uintptr_t kva_to_pma(const volatile void * kp);
+static inline void * pma_to_kva(uintptr_t pma);
+
 // void * memory_alloc_page(void)
 // Allocates a physical page of memory. Returns a pointer to the direct-mapped
 // address of the page. Does not fail; panics if there are no free pages available.
 
 extern void * memory_alloc_page(void);
 
+// void * memory_alloc_page_unzeroed(void)
+// Like memory_alloc_page, but the contents of the page are undefined. Meant for
+// callers that overwrite the whole page anyway.
+
+extern void * memory_alloc_page_unzeroed(void);
+
+// int memory_prezero_page(void)
+// Zeroes one free page ahead of time so that a later memory_alloc_page does
+// not have to. Returns 1 if it did any work and 0 if there was nothing to do.
+// Called from the idle thread.
+
+extern int memory_prezero_page(void);
+
 // void memory_free_page(void * ptr)
 // Returns a physical memory page to the physical page allocator. The page must
 // have been previously allocated by memory_alloc_page.
 
 extern void memory_free_page(void * pp);
 
+// void * memory_alloc_pages(unsigned int order)
+// Allocates a block of 2^order physically contiguous pages, aligned to the
+// block size. Returns a pointer to the direct-mapped address of the first page.
+// Does not fail; panics if no large enough block is available.
+
+extern void * memory_alloc_pages(unsigned int order);
+
+// void memory_free_pages(void * pp, unsigned int order)
+// Returns a block of 2^order pages to the page allocator. The block must have
+// been allocated by memory_alloc_pages with the same order.
+
+extern void memory_free_pages(void * pp, unsigned int order);
+
+// unsigned int memory_block_order(const void * pp)
+// Returns the order of the allocated block of pages starting at /pp/.
+
+extern unsigned int memory_block_order(const void * pp);
+
+// void * memory_kvm_alloc(size_t size)
+// Allocates /size/ bytes, rounded up to whole pages, in the kernel virtual
+// area [KVM_START_VMA,KVM_END_VMA). The pages are mapped with global PTEs in
+// all memory spaces but need not be physically contiguous. Returns NULL if the
+// area has no large enough free range. Use kvmalloc rather than calling this
+// directly.
+
+extern void * memory_kvm_alloc(size_t size);
+
+// void memory_kvm_free(void * vp)
+// Unmaps and frees an allocation made by memory_kvm_alloc.
+
+extern void memory_kvm_free(void * vp);
+
+// void memory_swap_init(struct io_intf * io)
+// Uses the block device /io/ as swap space. Once it is set up, running out
+// of physical pages writes private user pages out to it instead of panicking.
+
+extern void memory_swap_init(struct io_intf * io);
+
+// void memory_balloon_init(size_t (*deflate)(size_t cnt))
+// Registers the balloon driver. When physical pages run out, /deflate/ is
+// asked to give up to /cnt/ ballooned pages back to the page allocator before
+// any user pages are swapped out. It returns the number of pages freed.
+
+extern void memory_balloon_init(size_t (*deflate)(size_t cnt));
+
+// void * memory_alloc_page_nowait(void)
+// Allocates a physical page without clearing it, like
+// memory_alloc_page_unzeroed, but returns NULL instead of reclaiming memory if
+// no page is free.
+
+extern void * memory_alloc_page_nowait(void);
+
+// size_t memory_free_page_cnt(void)
+// Returns the number of physical pages that are free.
+
+extern size_t memory_free_page_cnt(void);
+
+// void memory_get_stats(struct memory_stats * st)
+// Fills in /st/ with the page allocator, page table, swap and page fault
+// counters. Per-process resident set sizes and fault counts are kept in
+// struct process.
+
+extern void memory_get_stats(struct memory_stats * st);
+
 // void * memory_alloc_and_map_page (
 //        uintptr_t vma, uint_fast8_t rwxug_flags)
 // Allocates and maps a physical page.
@@ -122,12 +306,18 @@ extern void * memory_alloc_and_map_page (
 //        uintptr_t vma, size_t size, uint_fast8_t rwxug_flags)
 
 // Allocates and maps multiple physical pages in an address range. Equivalent to
-// calling memory_alloc_and_map_page for every page in the range.
+// calling memory_alloc_and_map_page for every page in the range, except that
+// aligned 2 MB runs of a user range are mapped as megapages when a physically
+// contiguous block is free.
 
 extern void * memory_alloc_and_map_range (
     uintptr_t vma, size_t size, uint_fast8_t rwxug_flags);
 
 // void memory_unmap_and_free_range(void * vp, size_t size)
+// Unmaps the user pages in a range and drops their references. Unmapped
+// pages in the range are skipped.
+
+extern void memory_unmap_and_free_range(void * vp, size_t size);
 
 // void memory_unmap_and_free_user(void)
 // Unmaps and frees all pages with the U bit set in the PTE flags.
@@ -161,20 +351,116 @@ extern int memory_validate_vptr_len (
 extern int memory_validate_vstr (
     const char * vs, uint_fast8_t ug_flags);
 
-// Called from excp.c to handle a page fault at the specified address. Either
-// maps a page containing the faulting address, or calls process_exit().
+// int memory_region_add (
+//     struct mem_region * tab, uintptr_t vma, size_t size, uint_fast8_t flags,
+//     struct io_intf * io, uint64_t off, size_t len)
+// Records a demand-paged region of /size/ bytes at /vma/ in the region table
+// /tab/. The first /len/ bytes come from /io/ starting at offset /off/; the
+// rest is zero-filled. Takes a reference on /io/. Returns 0 on success or
+// -EINVAL if the range is outside the user window or the table is full.
+
+extern int memory_region_add (
+    struct mem_region * tab, uintptr_t vma, size_t size, uint_fast8_t flags,
+    struct io_intf * io, uint64_t off, size_t len);
+
+// void memory_region_copy(struct mem_region * dst, const struct mem_region * src)
+// Copies a region table for a forked process, taking new file references.
+
+extern void memory_region_copy (
+    struct mem_region * dst, const struct mem_region * src);
+
+// void memory_region_clear(struct mem_region * tab)
+// Empties a region table and drops its file references. Pages already mapped
+// from the regions are not affected.
+
+extern void memory_region_clear(struct mem_region * tab);
+
+// uintptr_t memory_region_place (
+//     const struct mem_region * tab, uintptr_t lo, uintptr_t hi, size_t size)
+// Finds a page-aligned address in [lo,hi) where /size/ bytes fit without
+// overlapping a region of /tab/ or any mapped page. Returns 0 if there is no
+// such address.
+
+extern uintptr_t memory_region_place (
+    const struct mem_region * tab, uintptr_t lo, uintptr_t hi, size_t size);
 
-extern void memory_handle_page_fault(const void * vptr);
+// int memory_region_remove(struct mem_region * tab, uintptr_t vma)
+// Removes the region starting at /vma/ from /tab/, unmapping its pages and
+// dropping its file reference. Returns -EINVAL if no region starts at /vma/.
+
+extern int memory_region_remove(struct mem_region * tab, uintptr_t vma);
+
+// int copy_from_user(void * dst, const void * usrc, size_t n)
+// int copy_to_user(void * udst, const void * src, size_t n)
+// Copy /n/ bytes between kernel memory and user memory of the active memory
+// space. Each user page is checked once, and pages that are not resident yet
+// are brought in. Return 0 on success or -EACCESS if the user range is not
+// readable (copy_from_user) or writable (copy_to_user).
+
+extern int copy_from_user(void * dst, const void * usrc, size_t n);
+extern int copy_to_user(void * udst, const void * src, size_t n);
+
+// long strncpy_from_user(char * dst, const char * usrc, size_t n)
+// Copies a null-terminated user string of at most /n/ bytes, including the
+// null byte, to /dst/. Returns the length of the string, -EACCESS if it is not
+// readable user memory, or -EINVAL if it is longer than n-1 bytes.
+
+extern long strncpy_from_user(char * dst, const char * usrc, size_t n);
+
+// void memory_space_sample(uintptr_t mtag, struct memory_sample * smp)
+// Fills in /smp/ with the number of user pages mapped in the memory space
+// /mtag/ and how many of them were accessed or written since the previous
+// sample, then starts a new sampling interval by clearing the accessed and
+// dirty bits of its user mappings.
+
+extern void memory_space_sample(uintptr_t mtag, struct memory_sample * smp);
+
+// Called from excp.c to handle a page fault at the specified address.
+// /access/ is PTE_R, PTE_W or PTE_X for a load, store or instruction fetch.
+// Either maps a page of a demand-paged region of the current process, maps
+// the shared zero page (for a load) or a fresh zero page, gives the memory
+// space a private copy of a copy-on-write page, or calls process_exit().
+
+extern void memory_handle_page_fault(const void * vptr, uint_fast8_t access);
 
 // INLINE FUNCTION DEFINITIONS
 //
 
+extern int running_hart(void); // thread.h
+
+static inline uintptr_t kva_to_pma(const volatile void * kp) {
+    if ((uintptr_t)kp < RAM_HIGH_VMA)
+        return (uintptr_t)kp;
+    else
+        return (uintptr_t)kp - RAM_HIGH_VMA + RAM_HIGH_PMA;
+}
+
+static inline void * pma_to_kva(uintptr_t pma) {
+    if (pma < RAM_HIGH_PMA)
+        return (void*)pma;
+    else
+        return (void*)(pma - RAM_HIGH_PMA + RAM_HIGH_VMA);
+}
+
 static inline uintptr_t active_memory_space(void) {
     return csrr_satp();
 }
 
 static inline uintptr_t memory_space_switch(uintptr_t mtag) {
-    return csrrw_satp(mtag);
+    uintptr_t old_mtag = csrr_satp();
+
+    if (mtag == old_mtag)
+        return old_mtag;
+
+    csrw_satp(mtag);
+
+    if (MTAG_ASID(mtag) == 0 && mtag != asid0_mtag[running_hart()]) {
+        // Flush ASID 0 only; rs2 = x0 would flush every ASID
+        asm inline ("sfence.vma zero, %0" :: "r" (0UL) : "memory");
+        asid0_mtag[running_hart()] = mtag;
+    }
+
+    return old_mtag;
 }
 
 #endif // _MEMORY_H_
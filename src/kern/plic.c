@@ -3,6 +3,8 @@
 
 #include "plic.h"
 #include "console.h"
+#include "thread.h"
+#include "config.h"
 
 #include <stdint.h>
 
@@ -17,7 +19,11 @@
 #endif
 
 #define PLIC_SRCCNT 0x400
-#define PLIC_CTXCNT 2
+#define PLIC_CTXCNT (2*NHART)
+
+// Context of S mode on a hart (even contexts are M mode)
+
+#define PLIC_SCTX(hartid) (2*(hartid)+1)
 
 // PLIC MEMORY OFFSETS
 #define PLIC_PEND   0x001000
@@ -42,9 +48,8 @@ extern void plic_set_context_threshold(uint32_t ctxno, uint32_t level);
 extern uint32_t plic_claim_context_interrupt(uint32_t ctxno);
 extern void plic_complete_context_interrupt(uint32_t ctxno, uint32_t srcno);
 
-// Currently supports only single-hart operation. The low-level PLIC functions
-// already understand contexts, so we only need to modify the high-level
-// functions (plic_init, plic_claim, plic_complete).
+// Every source is enabled for the S mode context of each hart, so whichever
+// hart the PLIC interrupts first claims the interrupt; the others claim 0.
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -53,12 +58,21 @@ void plic_init(void) {
     int i;
 
     // Disable all sources by setting priority to 0, enable all sources for
-    // context 1 (S mode on hart 0).
+    // S mode on hart 0.
 
-    for (i = 0; i < PLIC_SRCCNT; i++) {
+    for (i = 0; i < PLIC_SRCCNT; i++)
         plic_set_source_priority(i, 0);
-        plic_enable_source_for_context(1, i);
-    }
+
+    plic_init_hart(0);
+}
+
+extern void plic_init_hart(int hartid) {
+    int i;
+
+    trace("%s(hartid=%d)", __func__, hartid);
+
+    for (i = 0; i < PLIC_SRCCNT; i++)
+        plic_enable_source_for_context(PLIC_SCTX(hartid), i);
 }
 
 extern void plic_enable_irq(int irqno, int prio) {
@@ -74,15 +88,13 @@ extern void plic_disable_irq(int irqno) {
 }
 
 extern int plic_claim_irq(void) {
-    // Hardwired context 1 (S mode on hart 0)
     trace("%s()", __func__);
-    return plic_claim_context_interrupt(1);
+    return plic_claim_context_interrupt(PLIC_SCTX(running_hart()));
 }
 
 extern void plic_close_irq(int irqno) {
-    // Hardwired context 1 (S mode on hart 0)
     trace("%s(irqno=%d)", __func__, irqno);
-    plic_complete_context_interrupt(1, irqno);
+    plic_complete_context_interrupt(PLIC_SCTX(running_hart()), irqno);
 }
 
 // INTERNAL FUNCTION DEFINITIONS
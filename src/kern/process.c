@@ -10,6 +10,7 @@
 #include "trap.h"
 #include "thread.h"
 #include "halt.h"
+#include "string.h"
 
 #ifdef PROCESS_TRACE
 #define TRACE
@@ -20,17 +21,13 @@
 #endif
 
 
-// COMPILE-TIME PARAMETERS
+// INTERNAL FUNCTION DECLARATIONS
 //
 
-// NPROC is the maximum number of processes
-
-#ifndef NPROC
-#define NPROC 16
-#endif
+// Constructor of process_cache objects: a process with no open I/O objects
+// and no demand-paged regions.
 
-// INTERNAL FUNCTION DECLARATIONS
-//
+static void process_ctor(void * obj);
 
 // INTERNAL GLOBAL VARIABLES
 //
@@ -41,6 +38,10 @@
 
 static struct process main_proc;
 
+// Cache of free process structs, kept in their constructed state
+
+static struct kmem_cache process_cache;
+
 // A table of pointers to all user processes in the system
 
 struct process * proctab[NPROC] = {
@@ -63,10 +64,15 @@ void procmgr_init(void){
     main_proc.tid = running_thread();
     main_proc.mtag = active_memory_space();
     thread_set_process(main_proc.tid, &main_proc);
+    kmem_cache_init(&process_cache, "process",
+        sizeof(struct process), process_ctor, NULL);
+    procmgr_initialized = 1;
 }
 
 int process_exec(struct io_intf *exeio){
+    struct process * process = current_process();
     memory_unmap_and_free_user();
+    memory_region_clear(process->regions);
     void (*entryptr)(void);
     // uintptr_t new_mtag = memory_space_create(0);
     // memory_space_switch(new_mtag);
@@ -74,6 +80,8 @@ int process_exec(struct io_intf *exeio){
     if(status < 0){
         panic("ELF_LOAD FAILED!!!!!!!");
     }
+    // The segments hold their own references to the executable
+    ioclose(exeio);
     thread_jump_to_user(USER_STACK_VMA, (uintptr_t)entryptr);
     process_exit();
 }
@@ -94,7 +102,7 @@ int process_exec(struct io_intf *exeio){
  * the child process starts execution at the same point as the parent.
  *
  * Side effects:
- *  Allocates a new process structure, clones the parent's memory space, and increments reference
+ *  Takes a process structure from the process cache, clones the parent's memory space, and increments reference
  *  counts for shared I/O resources. Calls `thread_fork_to_user` to initialize a new thread for the child process.
  */
 int process_fork(struct trap_frame * tfr){
@@ -107,31 +115,55 @@ int process_fork(struct trap_frame * tfr){
     if(new_pid >= NPROC){
         return -EINVAL;
     }
-    struct process * new_process = (struct process *)kmalloc(sizeof(struct process));
+    struct process * new_process = kmem_cache_alloc(&process_cache);
     new_process->id = new_pid;
 
-    //TODO CP3: process fork here!
-    uintptr_t new_mtag = memory_space_clone(0);
+    uintptr_t new_mtag = memory_space_clone(memory_asid_alloc());
     new_process->mtag = new_mtag;
+    proctab[new_pid] = new_process;
 
+    // The child starts out mapping the same pages as the parent
     struct process * process = current_process();
+    new_process->rss = process->rss;
+    new_process->minflt = 0;
+    new_process->majflt = 0;
     for(int i = 0; i < PROCESS_IOMAX; i++){
         new_process->iotab[i] = process->iotab[i];
         if(process->iotab[i] != NULL){
             ioref(process->iotab[i]);
         }
     }
+    memory_region_copy(new_process->regions, process->regions);
     thread_fork_to_user(new_process, tfr);
     return new_pid;
 }
 
 void process_exit(void){
-    memory_unmap_and_free_user();
     struct process * process = current_process();
     for(int i = 0; i < PROCESS_IOMAX; i++){
         if(process->iotab[i] != NULL){
             ioclose(process->iotab[i]);
+            process->iotab[i] = NULL;
         }
     }
+    memory_region_clear(process->regions);
+
+    // The main process keeps its memory space, which is shared with the
+    // kernel. Any other process gives back its page tables and ASID.
+    if(process == &main_proc){
+        memory_unmap_and_free_user();
+    }else{
+        memory_space_reclaim();
+        proctab[process->id] = NULL;
+        thread_set_process(process->tid, NULL);
+        kmem_cache_free(&process_cache, process);
+    }
     thread_exit();
-}
\ No newline at end of file
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static void process_ctor(void * obj) {
+    memset(obj, 0, sizeof(struct process));
+}
@@ -8,6 +8,12 @@
 #define PROCESS_IOMAX 16
 #endif
 
+// NPROC is the maximum number of processes
+
+#ifndef NPROC
+#define NPROC 16
+#endif
+
 #include "config.h"
 #include "io.h"
 #include "thread.h"
@@ -21,5 +21,10 @@
 #define SYSCALL_USLEEP  40
 #define SYSCALL_WAIT    41
 
+#define SYSCALL_MMAP    50
+#define SYSCALL_MUNMAP  51
+
+#define SYSCALL_RESERVE 60
+
 
 #endif // _SCNUM_H_
@@ -0,0 +1,181 @@
+// smp.c - Multi-hart support
+//
+
+#ifdef SMP_TRACE
+#define TRACE
+#endif
+
+#ifdef SMP_DEBUG
+#define DEBUG
+#endif
+
+#include "smp.h"
+#include "thread.h"
+#include "memory.h"
+#include "intr.h"
+#include "timer.h"
+#include "console.h"
+#include "halt.h"
+#include "sync.h"
+#include "config.h"
+
+#include <stdint.h>
+
+// INTERNAL COMPILE-TIME CONSTANT DEFINITIONS
+//
+
+// Writing 1 to a hart's msip register in the CLINT raises a machine software
+// interrupt on it, which _mmode_trap_entry (trapasm.s) passes on to S mode.
+
+#define CLINT_MSIP_ADDR(hartid) (0x2000000UL + 4 * (hartid))
+
+// EXPORTED GLOBAL VARIABLE DEFINITIONS
+//
+
+char smp_initialized = 0;
+int smp_hart_cnt = 1;
+
+// Used by start.s. Each hart other than hart 0 sets its smp_hart_present flag
+// and waits for smp_init to give it the stack anchor of its idle thread.
+// smp_mmode_save is the area in which _mmode_trap_entry saves registers.
+
+volatile char smp_hart_present[NHART];
+struct thread_stack_anchor * volatile smp_boot_anchor[NHART];
+uint64_t smp_mmode_save[NHART][2];
+
+// INTERNAL GLOBAL VARIABLE DEFINITIONS
+//
+
+// The kernel lock is a ticket lock, so harts get into the kernel in the order
+// they arrive. Hart 0 runs main holding ticket 0.
+
+static struct spinlock kernel_spinlock = {
+    .name = "kernel",
+    .next = 1
+};
+
+static char hart_online[NHART];
+
+// Set by smp_tlb_shootdown and cleared by the hart once it flushed its TLB
+
+static uint32_t tlb_flush_pending[NHART];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// void smp_hart_main(void)
+// Called from start.s on each hart other than hart 0, running as the hart's
+// idle thread. Does not return.
+
+extern void smp_hart_main(void) __attribute__ ((noreturn));
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void smp_init(void) {
+    struct thread_stack_anchor * anchor;
+    int hartid;
+
+    trace("%s()", __func__);
+
+    hart_online[0] = 1;
+
+    // Harts that are not present by now (there is one per -smp vCPU) either
+    // do not exist or are parked in start.s.
+
+    for (hartid = 1; hartid < NHART; hartid++) {
+        if (!smp_hart_present[hartid])
+            continue;
+
+        anchor = thread_create_idle(hartid);
+        smp_wmb(); // idle thread is set up before the hart sees it
+        smp_boot_anchor[hartid] = anchor;
+        smp_send_ipi(hartid);
+    }
+
+    smp_initialized = 1;
+}
+
+// Unlike spinlock_acquire and spinlock_release, these leave the interrupt
+// state alone, as the lock is released in a different place than where it was
+// acquired, e.g. on the way back to user mode.
+
+void kernel_lock(void) {
+    const int hartid = running_hart();
+    const uint32_t ticket = atomic_add(&kernel_spinlock.next, 1);
+
+    // The hart holding the lock may be waiting for us to flush our TLB
+    // (smp_tlb_shootdown), so check for that while we wait.
+
+    while (atomic_read(&kernel_spinlock.owner) != ticket) {
+        if (atomic_read(&tlb_flush_pending[hartid])) {
+            asm inline ("sfence.vma" ::: "memory");
+            smp_mb();
+            atomic_set(&tlb_flush_pending[hartid], 0);
+        }
+    }
+
+    smp_mb();
+}
+
+void kernel_unlock(void) {
+    smp_mb();
+    atomic_set(&kernel_spinlock.owner, kernel_spinlock.owner + 1);
+}
+
+void smp_send_ipi(int hartid) {
+    trace("%s(%d)", __func__, hartid);
+    assert (0 <= hartid && hartid < NHART);
+
+    // Make our memory writes visible before the interrupt arrives
+
+    smp_mb();
+    *(volatile uint32_t *)CLINT_MSIP_ADDR(hartid) = 1;
+}
+
+void smp_tlb_shootdown(void) {
+    const int self = running_hart();
+    int hartid;
+
+    if (smp_hart_cnt == 1)
+        return;
+
+    trace("%s()", __func__);
+
+    // Every other hart is in user mode, asleep in its idle thread or waiting
+    // for the kernel lock. The IPI brings the first two into kernel_lock too.
+
+    for (hartid = 0; hartid < NHART; hartid++) {
+        if (hartid != self && hart_online[hartid]) {
+            atomic_set(&tlb_flush_pending[hartid], 1);
+            smp_send_ipi(hartid);
+        }
+    }
+
+    for (hartid = 0; hartid < NHART; hartid++) {
+        while (atomic_read(&tlb_flush_pending[hartid]))
+            continue;
+    }
+
+    smp_mb();
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void smp_hart_main(void) {
+    const int hartid = running_hart();
+
+    memory_init_hart();
+    intr_init_hart();
+    timer_init_hart();
+
+    kernel_lock();
+
+    hart_online[hartid] = 1;
+    smp_hart_cnt += 1;
+    kprintf("Hart %d online\n", hartid);
+
+    intr_enable();
+    thread_idle();
+}
@@ -0,0 +1,54 @@
+// smp.h - Multi-hart support
+//
+
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include "config.h"
+
+// EXPORTED GLOBAL VARIABLE DECLARATIONS
+//
+
+extern char smp_initialized;
+
+// Number of harts running the kernel, including hart 0
+
+extern int smp_hart_cnt;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void smp_init(void)
+// Starts the other harts of the machine, if any. Each one sets itself up as
+// hart 0 did in main and then runs its own idle thread, taking work from the
+// ready lists of the other harts. Must be called on hart 0 after the thread
+// manager and the timer are initialized.
+
+extern void smp_init(void);
+
+// void kernel_lock(void)
+// void kernel_unlock(void)
+// Acquire and release the kernel lock. A hart holds the kernel lock whenever
+// it runs kernel code, so kernel data structures are only ever touched by one
+// hart at a time. The lock is released while a hart runs in user mode and
+// while its idle thread sleeps. Hart 0 starts out holding it. Both must be
+// called with interrupts disabled.
+
+extern void kernel_lock(void);
+extern void kernel_unlock(void);
+
+// void smp_send_ipi(int hartid)
+// Sends an inter-processor interrupt to hart /hartid/. On the receiving hart,
+// it wakes the idle thread from wfi or makes a hart in user mode trap into
+// the kernel.
+
+extern void smp_send_ipi(int hartid);
+
+// void smp_tlb_shootdown(void)
+// Makes every other hart flush its TLB, and waits until they have. Must be
+// called after changing mappings that another hart may have cached: global
+// kernel mappings and those of memory spaces that may be active elsewhere.
+
+extern void smp_tlb_shootdown(void);
+
+#endif // _SMP_H_
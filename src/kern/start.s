@@ -1,4 +1,13 @@
         .section	.text
+
+        .equ    NHART, 4 # must match NHART in config.h
+
+        # All harts start here. Any beyond the NHART we support are parked.
+        # The hart id is kept in a0 until we are in S mode.
+
+        csrr    a0, mhartid
+        li      t0, NHART
+        bgeu    a0, t0, park
         
         # Delegate to S mode all S mode interrupts and all exceptions except
         # ecall from S mode and M mode; ecalls from S mode are used to provide
@@ -28,6 +37,17 @@
         csrs    mcounteren, 7
         csrs    scounteren, 7
 
+        # Point mscratch to the hart's save area for _mmode_trap_entry, and
+        # enable machine software interrupts, which are used for IPIs. Both
+        # are defined in smp.c.
+
+        la      t0, smp_mmode_save
+        slli    t1, a0, 4
+        add     t0, t0, t1
+        csrw    mscratch, t0
+        li      t0, 0x8 # MSIE
+        csrs    mie, t0
+
         # Switch to S mode
 
         li      t0, 0x1080 # bits to clear in mstatus (MPP=01,MPIE=0)
@@ -38,6 +58,7 @@
         csrw    mepc, t0
         mret
 1:      
+        bnez    a0, secondary
 
         # Set stack pointer. The main thread uses a statically-allocated stack
         # in the .data section.
@@ -51,6 +72,33 @@
         bnez    a0, halt_failure
         j       halt_success
 
+secondary:
+        # Let hart 0 know we are here, then wait for smp_init to give us the
+        # stack anchor of our idle thread. It sends an IPI once it has.
+
+        la      t0, smp_hart_present
+        add     t0, t0, a0
+        li      t1, 1
+        sb      t1, 0(t0)
+
+        la      t0, smp_boot_anchor
+        slli    t1, a0, 3
+        add     t0, t0, t1
+2:      wfi
+        ld      sp, 0(t0)
+        beqz    sp, 2b
+        fence   r, rw
+
+        # The anchor points to the idle thread, which we are now running as
+
+        ld      tp, 0(sp)
+        mv      fp, zero
+        call    smp_hart_main   # does not return
+
+park:
+        wfi
+        j       park
+
         .section        .data.stack, "wa", @progbits
         .balign		16
         
@@ -0,0 +1,231 @@
+// sync.h - Multi-hart synchronization primitives
+//
+
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+#include "intr.h"
+#include "halt.h"
+
+#include <stdint.h>
+
+// Atomic operations on 32-bit words, using the RISC-V A extension. All but
+// atomic_read and atomic_set are ordered with respect to both earlier and
+// later memory accesses (.aqrl). The operations that modify the word return
+// its previous value.
+
+static inline uint32_t atomic_read(const uint32_t * p);
+static inline void atomic_set(uint32_t * p, uint32_t val);
+static inline uint32_t atomic_add(uint32_t * p, uint32_t val);
+static inline uint32_t atomic_xchg(uint32_t * p, uint32_t val);
+static inline uint32_t atomic_cmpxchg(uint32_t * p, uint32_t old, uint32_t val);
+
+// Memory barriers. atomic_read and atomic_set are plain loads and stores, so
+// they need to be paired with these where the order matters.
+
+static inline void smp_mb(void);  // orders all memory accesses
+static inline void smp_rmb(void); // orders loads
+static inline void smp_wmb(void); // orders stores
+
+// A ticket spinlock. A hart acquiring the lock takes the next ticket and spins
+// until the ticket being served is its own, so harts get the lock in the order
+// they asked for it. The lock must not be held across anything that sleeps.
+
+struct spinlock {
+    const char * name;
+    uint32_t next; // next ticket to hand out
+    uint32_t owner; // ticket of the holder
+};
+
+// void spinlock_init(struct spinlock * lk, const char * name)
+// Initializes a spinlock. It is valid to initialize a spinlock with all zeroes.
+
+static inline void spinlock_init(struct spinlock * lk, const char * name);
+
+// int spinlock_acquire(struct spinlock * lk)
+// void spinlock_release(struct spinlock * lk, int saved_intr_state)
+// spinlock_acquire disables interrupts, so that an ISR on the same hart cannot
+// spin on a lock its hart holds, then acquires the lock. It returns the
+// previous interrupt state, which is to be passed to spinlock_release.
+
+static inline int spinlock_acquire(struct spinlock * lk);
+static inline void spinlock_release(struct spinlock * lk, int saved_intr_state);
+
+// A sequence lock, for data that is read much more often than it is written.
+// Writers serialize on a spinlock and make the sequence number odd while they
+// update the data. Readers do not write anything: they read the data between
+// seqlock_read_begin and seqlock_read_retry, and read it again if a writer got
+// in the way. Readers must only copy the data out, as they may see it in an
+// inconsistent state before retrying.
+//
+//     do {
+//         seq = seqlock_read_begin(&sl);
+//         ... copy data ...
+//     } while (seqlock_read_retry(&sl, seq));
+
+struct seqlock {
+    struct spinlock lock;
+    uint32_t seq;
+};
+
+static inline void seqlock_init(struct seqlock * sl, const char * name);
+static inline uint32_t seqlock_read_begin(const struct seqlock * sl);
+static inline int seqlock_read_retry(const struct seqlock * sl, uint32_t seq);
+
+// int seqlock_write_begin(struct seqlock * sl)
+// void seqlock_write_end(struct seqlock * sl, int saved_intr_state)
+// Bracket an update of the data. As for spinlock_acquire, interrupts are
+// disabled in between.
+
+static inline int seqlock_write_begin(struct seqlock * sl);
+static inline void seqlock_write_end(struct seqlock * sl, int saved_intr_state);
+
+// Reference counts. refcount_get adds a reference and returns the new count.
+// refcount_put drops one and returns 1 if it was the last.
+
+static inline uint32_t refcount_get(uint32_t * cnt);
+static inline int refcount_put(uint32_t * cnt);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline uint32_t atomic_read(const uint32_t * p) {
+    return *(const volatile uint32_t *)p;
+}
+
+static inline void atomic_set(uint32_t * p, uint32_t val) {
+    *(volatile uint32_t *)p = val;
+}
+
+static inline uint32_t atomic_add(uint32_t * p, uint32_t val) {
+    uint32_t old;
+
+    asm volatile (
+    "amoadd.w.aqrl  %0, %2, %1"
+    :   "=r" (old), "+A" (*p)
+    :   "r" (val)
+    :   "memory");
+
+    return old;
+}
+
+static inline uint32_t atomic_xchg(uint32_t * p, uint32_t val) {
+    uint32_t old;
+
+    asm volatile (
+    "amoswap.w.aqrl %0, %2, %1"
+    :   "=r" (old), "+A" (*p)
+    :   "r" (val)
+    :   "memory");
+
+    return old;
+}
+
+static inline uint32_t atomic_cmpxchg(uint32_t * p, uint32_t old, uint32_t val)
+{
+    uint32_t cur;
+    int fail;
+
+    // lr.w sign-extends the word it loads, so compare against the
+    // sign-extended value of old.
+
+    asm volatile (
+    "1:"                            "\n\t"
+    "lr.w.aqrl  %0, %2"             "\n\t"
+    "bne        %0, %3, 2f"         "\n\t"
+    "sc.w.aqrl  %1, %4, %2"         "\n\t"
+    "bnez       %1, 1b"             "\n\t"
+    "2:"
+    :   "=&r" (cur), "=&r" (fail), "+A" (*p)
+    :   "r" ((int32_t)old), "r" (val)
+    :   "memory");
+
+    return cur;
+}
+
+static inline void smp_mb(void) {
+    asm volatile ("fence rw, rw" ::: "memory");
+}
+
+static inline void smp_rmb(void) {
+    asm volatile ("fence r, r" ::: "memory");
+}
+
+static inline void smp_wmb(void) {
+    asm volatile ("fence w, w" ::: "memory");
+}
+
+static inline void spinlock_init(struct spinlock * lk, const char * name) {
+    lk->name = name;
+    lk->next = 0;
+    lk->owner = 0;
+}
+
+static inline int spinlock_acquire(struct spinlock * lk) {
+    int saved_intr_state;
+    uint32_t ticket;
+
+    saved_intr_state = intr_disable();
+    ticket = atomic_add(&lk->next, 1);
+
+    while (atomic_read(&lk->owner) != ticket)
+        continue;
+
+    smp_mb(); // critical section stays after the lock is acquired
+    return saved_intr_state;
+}
+
+static inline void spinlock_release(struct spinlock * lk, int saved_intr_state)
+{
+    assert (atomic_read(&lk->owner) != atomic_read(&lk->next));
+
+    smp_mb(); // critical section stays before the lock is released
+    atomic_set(&lk->owner, lk->owner + 1);
+    intr_restore(saved_intr_state);
+}
+
+static inline void seqlock_init(struct seqlock * sl, const char * name) {
+    spinlock_init(&sl->lock, name);
+    sl->seq = 0;
+}
+
+static inline uint32_t seqlock_read_begin(const struct seqlock * sl) {
+    uint32_t seq;
+
+    while ((seq = atomic_read(&sl->seq)) & 1)
+        continue;
+
+    smp_rmb();
+    return seq;
+}
+
+static inline int seqlock_read_retry(const struct seqlock * sl, uint32_t seq) {
+    smp_rmb();
+    return (atomic_read(&sl->seq) != seq);
+}
+
+static inline int seqlock_write_begin(struct seqlock * sl) {
+    int saved_intr_state;
+
+    saved_intr_state = spinlock_acquire(&sl->lock);
+    atomic_set(&sl->seq, sl->seq + 1);
+    smp_wmb();
+    return saved_intr_state;
+}
+
+static inline void seqlock_write_end(struct seqlock * sl, int saved_intr_state)
+{
+    smp_wmb();
+    atomic_set(&sl->seq, sl->seq + 1);
+    spinlock_release(&sl->lock, saved_intr_state);
+}
+
+static inline uint32_t refcount_get(uint32_t * cnt) {
+    return atomic_add(cnt, 1) + 1;
+}
+
+static inline int refcount_put(uint32_t * cnt) {
+    return (atomic_add(cnt, -1) == 1);
+}
+
+#endif // _SYNC_H_
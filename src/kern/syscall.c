@@ -8,6 +8,14 @@
 #include "process.h"
 #include "fs.h"
 #include "timer.h"
+#include "error.h"
+
+// Longest device or file name, including the null byte, accepted by devopen
+// and fsopen.
+
+#define SYSCALL_NAME_MAX 64
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
 
 const void syscall_handler(struct trap_frame * tfr);
 const int64_t syscall(struct trap_frame * tfr);
@@ -24,6 +32,9 @@ static int sysexec(int fd);
 static int sysfork(const struct trap_frame * tfr);
 static int sysusleep(unsigned long us);
 static int syswait(int tid);
+static long sysmmap(int fd, uint64_t off, size_t len);
+static int sysmunmap(void * addr);
+static int sysreserve(unsigned long runtime_us, unsigned long period_us);
 
 static long verify_fd(int fd);
 
@@ -64,6 +75,12 @@ int64_t syscall(struct trap_frame * tfr){
             return sysusleep((int)(regs[TFR_A0]));
         case SYSCALL_WAIT:
             return syswait((unsigned long)(regs[TFR_A0]));
+        case SYSCALL_MMAP:
+            return sysmmap((int)(regs[TFR_A0]), (uint64_t)(regs[TFR_A1]), (size_t)(regs[TFR_A2]));
+        case SYSCALL_MUNMAP:
+            return sysmunmap((void *)(regs[TFR_A0]));
+        case SYSCALL_RESERVE:
+            return sysreserve((unsigned long)(regs[TFR_A0]), (unsigned long)(regs[TFR_A1]));
         default:
             return 0;
             break;
@@ -78,20 +95,32 @@ static int sysexit(void) {
 }
 
 static int sysmsgout(const char * msg) {
-    int result;
+    char * kmsg;
+    long result;
     trace("%s(msg=%p)", __func__, msg);
-    result = memory_validate_vstr(msg, PTE_U);
-    if (result != 1){
-        return result;
+
+    kmsg = memory_alloc_page_unzeroed();
+    result = strncpy_from_user(kmsg, msg, PAGE_SIZE);
+    if (result >= 0){
+        kprintf("Thread <%s:%d> says: %s\n",
+            thread_name(running_thread()),
+            running_thread(), kmsg);
+        result = 0;
     }
-    kprintf("Thread <%s:%d> says: %s\n",
-        thread_name(running_thread()),
-        running_thread(), msg);
-    return 0;
+    memory_free_page(kmsg);
+    return result;
 }
 
 static int sysdevopen(int fd, const char *name, int instno){
     struct process * process = current_process();
+    char kname[SYSCALL_NAME_MAX];
+    long len;
+
+    len = strncpy_from_user(kname, name, sizeof(kname));
+    if(len < 0){
+        return len;
+    }
+
     if(fd >= PROCESS_IOMAX){
         kprintf("fd over max process\n");
         return -EINVAL;
@@ -114,7 +143,7 @@ static int sysdevopen(int fd, const char *name, int instno){
         return -EINVAL;
     }
 
-    int result = device_open(&devio, name, instno);
+    int result = device_open(&devio, kname, instno);
     if(result < 0){
         return -EINVAL;
     }
@@ -124,6 +153,14 @@ static int sysdevopen(int fd, const char *name, int instno){
 
 static int sysfsopen(int fd, const char *name){
     struct process * process = current_process();
+    char kname[SYSCALL_NAME_MAX];
+    long len;
+
+    len = strncpy_from_user(kname, name, sizeof(kname));
+    if(len < 0){
+        return len;
+    }
+
     if(fd >= PROCESS_IOMAX){
         kprintf("fd over max process\n");
         return -EINVAL;
@@ -146,7 +183,7 @@ static int sysfsopen(int fd, const char *name){
         return -EINVAL;
     }
 
-    int result = fs_open(name, &fsio);
+    int result = fs_open(kname, &fsio);
     if(result < 0){
         return -EINVAL;
     }
@@ -175,7 +212,31 @@ static long sysread(int fd, void *buf, size_t bufsz){
     }
 
     struct io_intf* devio = process->iotab[fd];
-    long bytes_read = ioread(devio, buf, bufsz);
+    void * kbuf = memory_alloc_page_unzeroed();
+    long bytes_read = 0;
+    long want, cnt;
+
+    // Read through a bounce page so each user page is checked only once
+    while(bytes_read < bufsz){
+        want = MIN(bufsz - bytes_read, PAGE_SIZE);
+        cnt = ioread(devio, kbuf, want);
+        if(cnt <= 0){
+            if(bytes_read == 0){
+                bytes_read = cnt;
+            }
+            break;
+        }
+        if(copy_to_user(buf + bytes_read, kbuf, cnt) != 0){
+            bytes_read = -EACCESS;
+            break;
+        }
+        bytes_read += cnt;
+        if(cnt < want){
+            break;
+        }
+    }
+
+    memory_free_page(kbuf);
     kprintf("Read %ld bytes from file.\n", bytes_read);
     return bytes_read;
 }
@@ -188,7 +249,28 @@ static long syswrite(int fd, const void *buf, size_t len){
     }
 
     struct io_intf* devio = process->iotab[fd];
-    long bytes_wrote = iowrite(devio, buf, len);
+    void * kbuf = memory_alloc_page_unzeroed();
+    long bytes_wrote = 0;
+    long cnt;
+
+    // Write through a bounce page so each user page is checked only once
+    while(bytes_wrote < len){
+        cnt = MIN(len - bytes_wrote, PAGE_SIZE);
+        if(copy_from_user(kbuf, buf + bytes_wrote, cnt) != 0){
+            bytes_wrote = -EACCESS;
+            break;
+        }
+        cnt = iowrite(devio, kbuf, cnt);
+        if(cnt <= 0){
+            if(bytes_wrote == 0){
+                bytes_wrote = cnt;
+            }
+            break;
+        }
+        bytes_wrote += cnt;
+    }
+
+    memory_free_page(kbuf);
     kprintf("Wrote %ld bytes to file.\n", bytes_wrote);
     return bytes_wrote;
 }
@@ -201,7 +283,24 @@ static int sysioctl(int fd, int cmd, void *arg){
     }
 
     struct io_intf* devio = process->iotab[fd];
-    long result = ioctl(devio, cmd, arg);
+    uint64_t karg = 0;
+    size_t argsz;
+    long result;
+
+    if(arg == NULL){
+        return ioctl(devio, cmd, NULL);
+    }
+
+    // All ioctl arguments are a uint64_t, except for IOCTL_GETBLKSZ
+    argsz = (cmd == IOCTL_GETBLKSZ) ? sizeof(uint32_t) : sizeof(uint64_t);
+    if(copy_from_user(&karg, arg, argsz) != 0){
+        return -EACCESS;
+    }
+
+    result = ioctl(devio, cmd, &karg);
+    if(result >= 0 && copy_to_user(arg, &karg, argsz) != 0){
+        return -EACCESS;
+    }
     return result;
 }
 
@@ -295,6 +394,107 @@ static int syswait(int tid){
     return -EINVAL;
 }
 
+/**
+ * Name: sysmmap
+ *
+ * Inputs:
+ *  int fd - File descriptor of the file to map
+ *  uint64_t off - Page-aligned offset in the file where the mapping starts
+ *  size_t len - Length of the mapping in bytes
+ *
+ * Outputs:
+ *  long - The user address of the mapping, or a negative error code.
+ *
+ * Purpose:
+ *  Maps part of an open file read-only into the mmap area of the user window. Nothing is read
+ *  here; each page is filled from the file when it is first accessed. Bytes past the end of the
+ *  file read as zero.
+ *
+ * Side effects:
+ *  Adds a demand-paged region to the current process, which holds a reference to the file until
+ *  the region is unmapped or the process exits.
+ */
+static long sysmmap(int fd, uint64_t off, size_t len){
+    struct process * process = current_process();
+    long verify = verify_fd(fd);
+    if(verify < 0){
+        return verify;
+    }
+    if(len == 0 || (off & (PAGE_SIZE - 1)) != 0){
+        return -EINVAL;
+    }
+
+    struct io_intf* fileio = process->iotab[fd];
+    uint64_t filelen;
+    int result = ioctl(fileio, IOCTL_GETLEN, &filelen);
+    if(result < 0){
+        return result;
+    }
+
+    uintptr_t vma = memory_region_place(process->regions, USER_MMAP_VMA, USER_MMAP_END_VMA, len);
+    if(vma == 0){
+        return -ENOMEM;
+    }
+
+    size_t filesz = (off < filelen) ? filelen - off : 0;
+    if(filesz > len){
+        filesz = len;
+    }
+
+    result = memory_region_add(process->regions, vma, len, PTE_R | PTE_U, fileio, off, filesz);
+    if(result < 0){
+        return result;
+    }
+    return vma;
+}
+
+/**
+ * Name: sysmunmap
+ *
+ * Inputs:
+ *  void * addr - Address returned by an earlier mmap call
+ *
+ * Outputs:
+ *  int - 0 on success, or a negative error code.
+ *
+ * Purpose:
+ *  Removes a mapping created by mmap.
+ *
+ * Side effects:
+ *  Unmaps and frees the pages of the mapping and drops its reference to the file.
+ */
+static int sysmunmap(void * addr){
+    struct process * process = current_process();
+    uintptr_t vma = (uintptr_t)addr;
+    if(vma < USER_MMAP_VMA || vma >= USER_MMAP_END_VMA){
+        return -EINVAL;
+    }
+    return memory_region_remove(process->regions, vma);
+}
+
+/**
+ * Name: sysreserve
+ *
+ * Inputs:
+ *  unsigned long runtime_us - CPU time reserved per period, in microseconds, or 0 to cancel
+ *  unsigned long period_us - Length of a period, in microseconds
+ *
+ * Outputs:
+ *  int - 0 on success, -EINVAL for an invalid reservation, or -EBUSY if admission control
+ *  rejects it.
+ *
+ * Purpose:
+ *  Lets a periodic task, e.g. an animation, reserve CPU time so that it meets its deadlines
+ *  while other processes are busy. The thread is scheduled earliest deadline first, ahead of
+ *  other threads, for up to runtime_us in each period.
+ *
+ * Side effects:
+ *  Moves the current thread to the EDF scheduling class, or back to the default class.
+ */
+static int sysreserve(unsigned long runtime_us, unsigned long period_us){
+    return thread_reserve(runtime_us, period_us);
+}
+
 static long verify_fd(int fd){
     struct process * process = current_process();
     if(fd >= PROCESS_IOMAX){
@@ -175,16 +175,26 @@ _thread_finish_fork:
         # loop:
         # j loop
 
+        # Switch to the child and its stack, on which the trap frame (a1) was
+        # copied. The parent only becomes visible to other harts in
+        # fork_release_parent, which also releases the kernel lock, as we no
+        # longer touch its context or stack.
+
+        mv      t0, tp
         mv      tp, a0
+        mv      sp, a1
+        mv      a0, t0
+        call    fork_release_parent
+
         la      a0, _trap_entry_from_umode
         csrw    stvec, a0
 
-        ld      t6, 33*8(a1)
+        ld      t6, 33*8(sp)
         csrw    sepc, t6
-        ld      t6, 32*8(a1)
+        ld      t6, 32*8(sp)
         csrw    sstatus, t6
 
-        mv      t6, a1
+        mv      t6, sp
 
         ld      x30, 30*8(t6)   # x30 is t5
         ld      x29, 29*8(t6)   # x29 is t4
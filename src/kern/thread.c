@@ -15,6 +15,11 @@
 #include "process.h"
 #include "memory.h"
 #include "trap.h"
+#include "smp.h"
+#include "timer.h"
+#include "lock.h"
+#include "error.h"
+#include "config.h"
 
 // COMPILE-TIME PARAMETERS
 //
@@ -25,6 +30,37 @@
 #define NTHR 16
 #endif
 
+// MLFQ_NLEVEL is the number of priority levels of the MLFQ scheduling class.
+// A thread at level k may run for MLFQ_ALLOT << k ticks in all before it moves
+// down a level. Every MLFQ_BOOST_TICKS ticks, all threads go back to the top.
+
+#ifndef MLFQ_NLEVEL
+#define MLFQ_NLEVEL 4
+#endif
+
+#ifndef MLFQ_ALLOT
+#define MLFQ_ALLOT 2
+#endif
+
+#ifndef MLFQ_BOOST_TICKS
+#define MLFQ_BOOST_TICKS 50
+#endif
+
+// The EDF scheduling class admits a reservation only if the reservations on
+// the hart add up to at most EDF_UTIL_MAX_PCT percent of it. The rest is left
+// for threads of the other classes. EDF_PERIOD_MAX_US is the longest period a
+// reservation may have.
+
+#ifndef EDF_UTIL_MAX_PCT
+#define EDF_UTIL_MAX_PCT 90
+#endif
+
+#ifndef EDF_PERIOD_MAX_US
+#define EDF_PERIOD_MAX_US 10000000UL
+#endif
+
+#define EDF_UTIL_ONE (1UL << 20) // fixed-point scale of hart utilization
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -55,6 +91,20 @@ struct thread {
     size_t stack_size;
     enum thread_state state;
     int id;
+    int hart; // hart the thread is running on or last ran on
+    int queued_hart; // hart whose ready lists hold the thread if READY
+    const struct sched_class * sched; // scheduling class
+    int sched_level; // MLFQ level, 0 is the highest
+    unsigned int sched_ticks; // ticks used at the current MLFQ level
+    uint64_t rt_runtime; // EDF: reserved time per period (timer counts)
+    uint64_t rt_period; // EDF: reservation period (timer counts)
+    uint64_t rt_deadline; // EDF: end of the current period
+    uint64_t rt_start; // EDF: time the thread was last charged
+    int64_t rt_budget; // EDF: reserved time left in the current period
+    char rt_throttled; // EDF: out of budget until rt_deadline
+    struct thread * pi_donor; // waiter whose priority the thread inherits
+    struct lock * wait_lock; // lock the thread is waiting to acquire
+    struct lock * held_locks; // locks the thread holds, linked by next
     struct process * proc;
     struct thread * parent;
     struct thread * list_next;
@@ -62,6 +112,54 @@ struct thread {
     struct condition child_exit;
 };
 
+// Per-hart scheduler state. A hart runs the threads on its own ready lists, or
+// its idle thread if there are none. The idle thread is never on a ready list.
+
+struct hart {
+    struct thread_list edf_list; // READY EDF threads, by deadline
+    struct thread_list edf_throttled; // EDF threads out of budget, likewise
+    uint64_t edf_util; // reservations on the hart (EDF_UTIL_ONE is all)
+    struct thread_list ready_list; // threads of the FIFO class
+    struct thread_list mlfq_list[MLFQ_NLEVEL]; // threads of the MLFQ class
+    struct thread * idle_thread;
+    struct thread * curr; // thread running on the hart
+    char idle; // idle thread is waiting for an interrupt
+};
+
+// A scheduling class is a policy for choosing the next thread to run. Each
+// thread belongs to a class, which keeps it in struct hart while it is READY.
+// A hart runs a thread of the first class in sched_classes that has one. The
+// functions are called with interrupts disabled.
+//
+// A thread holding a lock that a higher-priority thread waits for inherits
+// the priority of that thread, its pi_donor, and is scheduled by the donor's
+// class with the donor's level or deadline (see pi_source).
+//
+// enqueue puts a READY thread on the hart's ready lists. Argument /wakeup/ is
+// 1 if the thread was woken up from condition_wait, and 0 if it is new or was
+// running.
+//
+// pick_next returns the thread the hart should run next, or NULL if there is
+// none. dequeue takes a READY thread, usually that one, off the ready lists.
+//
+// stop, which may be NULL, is called when a thread of the class stops running,
+// before it is put back on the ready lists if it is still READY.
+//
+// tick is called on each timer tick of the hart, with the running thread if it
+// belongs to the class, or else NULL.
+//
+// Threads of a pinned class are not taken by other harts (see steal_thread).
+
+struct sched_class {
+    const char * name;
+    void (*enqueue)(struct hart * hart, struct thread * thr, int wakeup);
+    struct thread * (*pick_next)(struct hart * hart);
+    void (*dequeue)(struct hart * hart, struct thread * thr);
+    void (*stop)(struct hart * hart, struct thread * thr);
+    void (*tick)(struct hart * hart, struct thread * thr);
+    char pinned;
+};
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -89,7 +187,18 @@ static struct thread * thrtab[NTHR] = {
     [IDLE_TID] = &idle_thread
 };
 
-static struct thread_list ready_list;
+static struct hart hart_tab[NHART] = {
+    [0] = { .idle_thread = &idle_thread, .curr = &main_thread }
+};
+
+// Cache of free struct threads, each with its stack page still anchored to it
+// (see thread_ctor).
+
+static struct kmem_cache thread_cache;
+
+// Ticks until hart 0 next moves all MLFQ threads back to the top level
+
+static unsigned int mlfq_boost_ticks = MLFQ_BOOST_TICKS;
 
 // INTERNAL MACRO DEFINITIONS
 // 
@@ -108,6 +217,11 @@ static struct thread_list ready_list;
 
 #define CURTHR ((struct thread*)__builtin_thread_pointer())
 
+// Pointer to the scheduling class /name/, e.g. SCHED_CLASS(SCHED_DEFAULT)
+
+#define SCHED_CLASS(name) SCHED_CLASS_(name)
+#define SCHED_CLASS_(name) (&sched_##name)
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -131,23 +245,106 @@ static const char * thread_state_name(enum thread_state state)
 
 // void recycle_thread(int tid)
 // Reclaims a thread's slot in thrtab and makes its parent the parent of its
-// children. Frees the struct thread of the thread.
+// children. Returns the struct thread, along with its stack, to thread_cache.
 
 static void recycle_thread(int tid);
 
 // void suspend_self(void)
 // Suspends the currently running thread and resumes the next thread on the
-// ready-to-run list using _thread_swtch (in threasm.s). Must be called with
-// interrupts enabled. Returns when the current thread is next scheduled for
-// execution. If the current thread is RUNNING, it is marked READY and placed
-// on the ready-to-run list. Note that suspend_self will only return if the
-// current thread becomes READY.
+// hart's ready-to-run list, or the hart's idle thread if the list is empty,
+// using _thread_swtch (in threasm.s). Must be called with interrupts enabled.
+// Returns when the current thread is next scheduled for execution. If the
+// current thread is RUNNING, it is marked READY and placed on the ready-to-run
+// list, or simply keeps running if there is no other thread to run. Note that
+// suspend_self will only return if the current thread becomes READY.
 
 static void suspend_self(void);
 
+// void ready_thread(struct thread * thr, int wakeup)
+// Puts a READY thread on the ready lists of the hart it last ran on, and wakes
+// an idle hart to run it: that hart if it is idle, or else any other idle
+// hart, which will take the thread from it. If the thread's hart is busy with
+// a lower-priority thread, it is interrupted so that it yields on its way back
+// to user mode. Argument /wakeup/ is passed on to the thread's scheduling
+// class. Must be called with interrupts disabled.
+
+static void ready_thread(struct thread * thr, int wakeup);
+
+// int steal_thread(struct hart * hart)
+// Moves the thread another hart would run next to the ready lists of /hart/.
+// Returns 1 if there was a thread to take, or 0 otherwise.
+
+static int steal_thread(struct hart * hart);
+
+// void sched_enqueue(struct hart * hart, struct thread * thr, int wakeup)
+// struct thread * sched_dequeue_next(struct hart * hart, int steal)
+// int sched_has_ready(struct hart * hart)
+// Put a thread on the ready lists of /hart/ through its scheduling class, and
+// take off the thread the hart runs next, or return NULL if there is none. If
+// /steal/ is 1, threads of pinned classes are left alone. sched_has_ready
+// returns 1 if the hart has a thread to run, other than its idle thread.
+
+static void sched_enqueue(struct hart * hart, struct thread * thr, int wakeup);
+static struct thread * sched_dequeue_next(struct hart * hart, int steal);
+static int sched_has_ready(struct hart * hart);
+
+// Functions of the FIFO scheduling class. READY threads run in the order they
+// became ready. The class does nothing on a tick: a thread running in user
+// mode yields on every interrupt anyway (see intr_handler).
+
+static void fifo_enqueue(struct hart * hart, struct thread * thr, int wakeup);
+static struct thread * fifo_pick_next(struct hart * hart);
+static void fifo_dequeue(struct hart * hart, struct thread * thr);
+static void fifo_tick(struct hart * hart, struct thread * thr);
+
+// Functions of the MLFQ (multi-level feedback queue) scheduling class. A hart
+// runs the threads of the highest level first, in FIFO order within a level.
+// New threads start at the top level. A thread that has used up its allotment
+// at its level moves down one, so CPU-bound threads sink below interactive
+// ones. A thread woken up from condition_wait, which is how threads wait for
+// I/O, moves up a level. mlfq_boost moves every thread back to the top level,
+// so that none starves.
+
+static void mlfq_enqueue(struct hart * hart, struct thread * thr, int wakeup);
+static struct thread * mlfq_pick_next(struct hart * hart);
+static void mlfq_dequeue(struct hart * hart, struct thread * thr);
+static void mlfq_tick(struct hart * hart, struct thread * thr);
+static void mlfq_boost(void);
+
+// Functions of the EDF (earliest deadline first) scheduling class. Each thread
+// has a reservation of rt_runtime every rt_period, enforced as a constant
+// bandwidth server: it runs before the threads of the other classes while it
+// has budget left, in order of deadline, and is throttled until the end of
+// its period once it has used up its budget. A thread that wakes up too late
+// to use its budget by its deadline starts a new period. Threads of the class
+// stay on the hart they made their reservation on, whose utilization
+// (edf_util) accounts for them.
+
+static void edf_enqueue(struct hart * hart, struct thread * thr, int wakeup);
+static struct thread * edf_pick_next(struct hart * hart);
+static void edf_dequeue(struct hart * hart, struct thread * thr);
+static void edf_stop(struct hart * hart, struct thread * thr);
+static void edf_tick(struct hart * hart, struct thread * thr);
+static void edf_charge(struct thread * thr, uint64_t now);
+static void edf_insert(struct thread_list * list, struct thread * thr);
+static void edf_leave(struct thread * thr);
+
+// Priority inheritance. pi_source returns the thread whose scheduling class
+// and parameters /thr/ runs with: its donor if it has one, or else itself. A
+// donor is never itself boosted, as its own donor is taken instead.
+// sched_class_of returns the class of that thread. prio_higher compares the
+// own priority of two threads: by the order of their classes, then by MLFQ
+// level or EDF deadline. pi_set_donor changes the donor of a thread, moving
+// it on the ready lists if it is READY. Interrupts must be disabled.
+
+static inline struct thread * pi_source(struct thread * thr);
+static inline const struct sched_class * sched_class_of(struct thread * thr);
+static int prio_higher(const struct thread * a, const struct thread * b);
+static void pi_set_donor(struct thread * thr, struct thread * donor);
+
 // The following functions manipulate a thread list (struct thread_list). Note
 // that threads form a linked list via the list_next member of each thread
-// structure. Thread lists are used for the ready-to-run list (ready_list) and
+// structure. Thread lists are used for the ready-to-run list of each hart and
 // for the list of waiting threads of each condition variable. These functions
 // are not interrupt-safe! The caller must disable interrupts before calling any
 // thread list function that may modify a list that is used in an ISR.
@@ -156,10 +353,56 @@ static void tlclear(struct thread_list * list);
 static int tlempty(const struct thread_list * list);
 static void tlinsert(struct thread_list * list, struct thread * thr);
 static struct thread * tlremove(struct thread_list * list);
-static void tlappend(struct thread_list * l0, struct thread_list * l1);
+static int tlremove_thread(struct thread_list * list, struct thread * thr);
 
 static void idle_thread_func(void * arg);
 
+// Constructor and destructor of thread_cache objects. A constructed thread has
+// its own stack, with the stack anchor at the top pointing back to it, and an
+// empty child_exit condition.
+
+static void thread_ctor(void * obj);
+static void thread_dtor(void * obj);
+
+// SCHEDULING CLASS DEFINITIONS
+//
+
+static const struct sched_class sched_edf = {
+    .name = "edf",
+    .enqueue = edf_enqueue,
+    .pick_next = edf_pick_next,
+    .dequeue = edf_dequeue,
+    .stop = edf_stop,
+    .tick = edf_tick,
+    .pinned = 1
+};
+
+static const struct sched_class sched_fifo = {
+    .name = "fifo",
+    .enqueue = fifo_enqueue,
+    .pick_next = fifo_pick_next,
+    .dequeue = fifo_dequeue,
+    .tick = fifo_tick
+};
+
+static const struct sched_class sched_mlfq = {
+    .name = "mlfq",
+    .enqueue = mlfq_enqueue,
+    .pick_next = mlfq_pick_next,
+    .dequeue = mlfq_dequeue,
+    .tick = mlfq_tick
+};
+
+// Scheduling classes in order of precedence
+
+static const struct sched_class * const sched_classes[] = {
+    &sched_edf,
+    &sched_fifo,
+    &sched_mlfq
+};
+
+#define NSCHED (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
 // IMPORTED FUNCTION DECLARATIONS
 // defined in thrasm.s
 //
@@ -176,6 +419,14 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
 extern void  _thread_finish_fork (
     struct thread * child, const struct trap_frame * parent_tfr);
 
+// void fork_release_parent(struct thread * parent)
+// Called from _thread_finish_fork, running on the child's stack after the
+// parent's context is saved. Lets the parent's scheduling class know it
+// stopped running, puts the READY parent on a ready list and releases the
+// kernel lock. Must be called with interrupts disabled.
+
+extern void fork_release_parent(struct thread * parent);
+
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -184,16 +435,40 @@ int running_thread(void) {
     return CURTHR->id;
 }
 
+int running_hart(void) {
+    return CURTHR->hart;
+}
+
 void thread_init(void) {
+    kmem_cache_init(&thread_cache, "thread",
+        sizeof(struct thread), thread_ctor, thread_dtor);
     init_main_thread();
     init_idle_thread();
     set_running_thread(&main_thread);
     thrmgr_initialized = 1;
 }
 
+struct thread_stack_anchor * thread_create_idle(int hartid) {
+    struct thread * const thr = kmem_cache_alloc(&thread_cache);
+
+    assert (0 < hartid && hartid < NHART);
+
+    // Idle threads are not in thrtab and share the id of hart 0's idle thread
+
+    thr->id = IDLE_TID;
+    thr->name = "idle";
+    thr->hart = hartid;
+    thr->sched = NULL;
+    thr->parent = &main_thread;
+    thr->proc = NULL;
+    set_thread_state(thr, THREAD_RUNNING);
+
+    hart_tab[hartid].idle_thread = thr;
+    hart_tab[hartid].curr = thr;
+    return thr->stack_base;
+}
+
 int thread_spawn(const char * name, void (*start)(void *), void * arg) {
-    struct thread_stack_anchor * stack_anchor;
-    void * stack_page;
     struct thread * child;
     int saved_intr_state;
     int tid;
@@ -210,29 +485,27 @@ int thread_spawn(const char * name, void (*start)(void *), void * arg) {
     if (tid == NTHR)
         panic("Too many threads");
     
-    // Allocate a struct thread and a stack
-
-    child = kmalloc(sizeof(struct thread));
-
-    stack_page = memory_alloc_page();
-    stack_anchor = stack_page + PAGE_SIZE;
-    stack_anchor -= 1;
-    stack_anchor->thread = child;
-    stack_anchor->reserved = 0;
+    // Get a struct thread with a stack anchored to it
 
+    child = kmem_cache_alloc(&thread_cache);
 
     thrtab[tid] = child;
 
     child->id = tid;
     child->name = name;
+    child->hart = CURTHR->hart;
+    child->sched = SCHED_CLASS(SCHED_DEFAULT);
+    child->sched_level = 0;
+    child->sched_ticks = 0;
+    child->pi_donor = NULL;
+    child->wait_lock = NULL;
+    child->held_locks = NULL;
     child->parent = CURTHR;
     child->proc = CURTHR->proc;
-    child->stack_base = stack_anchor;
-    child->stack_size = child->stack_base - stack_page;
     set_thread_state(child, THREAD_READY);
 
     saved_intr_state = intr_disable();
-    tlinsert(&ready_list, child);
+    ready_thread(child, 0);
     intr_restore(saved_intr_state);
 
     _thread_setup(child, child->stack_base, start, arg);
@@ -244,6 +517,9 @@ void thread_exit(void) {
     if (CURTHR == &main_thread)
         halt_success();
     
+    if (CURTHR->sched == &sched_edf)
+        edf_leave(CURTHR);
+
     set_thread_state(CURTHR, THREAD_EXITED);
 
     // Signal parent in case it is waiting for us to exit
@@ -256,8 +532,12 @@ void thread_exit(void) {
 }
 
 void thread_jump_to_user(uintptr_t usp, uintptr_t upc) {
-    csrs_sstatus(RISCV_SSTATUS_SIE);
+    // Interrupts stay disabled until sret, as we must not take one in S mode
+    // once we no longer hold the kernel lock.
+
+    intr_disable();
     csrc_sstatus(RISCV_SSTATUS_SPIE);
+    kernel_unlock();
     _thread_finish_jump(CURTHR->stack_base, usp, upc);
 }
 
@@ -277,15 +557,13 @@ void thread_jump_to_user(uintptr_t usp, uintptr_t upc) {
  *  from child's memory space to finalize the fork and enter user mode.
  *
  * Side effects:
- *  Allocates thread structure and stack page for the child thread. Changes the current memory mapping 
+ *  Takes a thread structure with its stack page from the thread cache for the child thread. Changes the current memory mapping 
  *  to the child's memory space.  
  */
 int thread_fork_to_user(struct process * child_proc, const struct trap_frame * parent_tfr){
     // TODO CP3: fix me
-    struct thread_stack_anchor * stack_anchor;
-    void * stack_page;
+    struct trap_frame * child_tfr;
     struct thread * child;
-    int saved_intr_state;
     int tid;
 
     // Find a free thread slot.
@@ -298,42 +576,61 @@ int thread_fork_to_user(struct process * child_proc, const struct trap_frame * p
     if (tid == NTHR)
         panic("Too many threads");
     
-    // Allocate a struct thread and a stack
-
-    child = kmalloc(sizeof(struct thread));
-
-    stack_page = memory_alloc_page();
-    stack_anchor = stack_page + PAGE_SIZE;
-    stack_anchor -= 1;
-    stack_anchor->thread = child;
-    stack_anchor->reserved = 0;
+    // Get a struct thread with a stack anchored to it
 
+    child = kmem_cache_alloc(&thread_cache);
     thrtab[tid] = child;
 
     child->id = tid;
     child->name = "fork_child";
+    child->hart = CURTHR->hart;
+    child->sched = SCHED_CLASS(SCHED_DEFAULT);
+    child->sched_level = 0;
+    child->sched_ticks = 0;
+    child->pi_donor = NULL;
+    child->wait_lock = NULL;
+    child->held_locks = NULL;
     child->parent = CURTHR;
     child->proc = child_proc;
-    child->stack_base = stack_anchor;
-    child->stack_size = child->stack_base - stack_page;
     set_thread_state(child, THREAD_RUNNING);
     set_thread_state(CURTHR, THREAD_READY);
 
     child_proc->tid = tid;
 
-    saved_intr_state = intr_disable();
-    tlinsert(&ready_list, CURTHR);
-    intr_restore(saved_intr_state);
+    // The child returns to user mode from a copy of the parent's trap frame
+    // at the top of its own stack. Once the parent is on a ready list, another
+    // hart may resume it and reuse the parent's stack, so _thread_finish_fork
+    // saves the parent's context and moves to the child's stack before it
+    // calls fork_release_parent to make the parent READY.
+
+    child_tfr = (struct trap_frame *)child->stack_base - 1;
+    *child_tfr = *parent_tfr;
+
+    hart_tab[child->hart].curr = child;
     
     memory_space_switch(child_proc->mtag);
 
-    csrs_sstatus(RISCV_SSTATUS_SIE);
+    // As in thread_jump_to_user, leave with interrupts disabled
+
+    intr_disable();
     csrc_sstatus(RISCV_SSTATUS_SPIE);
     
-    _thread_finish_fork(child, parent_tfr);
+    _thread_finish_fork(child, child_tfr);
     return tid;
 }
 
+void fork_release_parent(struct thread * parent) {
+    struct hart * const hart = &hart_tab[parent->hart];
+
+    // Charge the parent for the time it ran, as suspend_self would
+
+    if (sched_class_of(parent)->stop != NULL)
+        sched_class_of(parent)->stop(hart, parent);
+
+    ready_thread(parent, 0);
+    kernel_unlock();
+}
+
 void thread_yield(void) {
     trace("%s() in %s", __func__, CURTHR->name);
 
@@ -431,6 +728,195 @@ const char * thread_name(int tid) {
     return thrtab[tid]->name;
 }
 
+int thread_reserve(unsigned long runtime_us, unsigned long period_us) {
+    struct thread * const thr = CURTHR;
+    struct hart * const hart = &hart_tab[thr->hart];
+    uint64_t runtime, period;
+    uint64_t old_util = 0;
+    uint64_t util;
+    int saved_intr_state;
+
+    trace("%s(%lu,%lu) in %s", __func__, runtime_us, period_us, thr->name);
+
+    if (thr == hart->idle_thread)
+        return -EINVAL;
+
+    saved_intr_state = intr_disable();
+
+    if (runtime_us == 0) {
+        if (thr->sched == &sched_edf)
+            edf_leave(thr);
+        intr_restore(saved_intr_state);
+        return 0;
+    }
+
+    if (period_us == 0 || EDF_PERIOD_MAX_US < period_us ||
+        period_us < runtime_us)
+    {
+        intr_restore(saved_intr_state);
+        return -EINVAL;
+    }
+
+    runtime = runtime_us * (TIMER_FREQ / 1000 / 1000);
+    period = period_us * (TIMER_FREQ / 1000 / 1000);
+    util = runtime * EDF_UTIL_ONE / period;
+
+    // Admission control: the hart must be able to meet every deadline
+
+    if (thr->sched == &sched_edf)
+        old_util = thr->rt_runtime * EDF_UTIL_ONE / thr->rt_period;
+
+    if (EDF_UTIL_MAX_PCT * EDF_UTIL_ONE / 100 < hart->edf_util - old_util + util)
+    {
+        intr_restore(saved_intr_state);
+        return -EBUSY;
+    }
+
+    hart->edf_util += util - old_util;
+
+    thr->sched = &sched_edf;
+    thr->rt_runtime = runtime;
+    thr->rt_period = period;
+    thr->rt_start = timer_get_time();
+    thr->rt_deadline = thr->rt_start + period;
+    thr->rt_budget = runtime;
+    thr->rt_throttled = 0;
+
+    intr_restore(saved_intr_state);
+    return 0;
+}
+
+// The donation follows the chain of lock owners: if the owner of /lk/ is itself
+// waiting for a lock, its new priority passes on to the owner of that lock,
+// and so on. It stops at a thread that already has a priority at least as
+// high. The chain is at most NTHR long unless there is a deadlock.
+
+void thread_lock_wait(struct lock * lk) {
+    struct thread * const donor = pi_source(CURTHR);
+    struct thread * owner;
+    int saved_intr_state;
+    int depth;
+
+    trace("%s(<%s>) in %s", __func__, lk->cond.name, CURTHR->name);
+    assert (lk->owner != NULL);
+
+    saved_intr_state = intr_disable();
+
+    CURTHR->wait_lock = lk;
+    owner = lk->owner;
+
+    for (depth = 0; owner != NULL && depth < NTHR; depth++) {
+        if (owner == CURTHR || !prio_higher(donor, pi_source(owner)))
+            break;
+
+        pi_set_donor(owner, donor);
+
+        if (owner->state != THREAD_WAITING || owner->wait_lock == NULL)
+            break;
+
+        owner = owner->wait_lock->owner;
+    }
+
+    condition_wait(&lk->cond);
+    CURTHR->wait_lock = NULL;
+
+    intr_restore(saved_intr_state);
+}
+
+void thread_lock_acquired(struct lock * lk) {
+    lk->owner = CURTHR;
+    lk->next = CURTHR->held_locks;
+    CURTHR->held_locks = lk;
+}
+
+// The current thread keeps the highest priority of the threads still waiting
+// for one of the locks it holds, or goes back to its own.
+
+void thread_lock_released(struct lock * lk) {
+    struct thread * donor = NULL;
+    struct lock ** pp;
+    struct lock * held;
+    struct thread * thr;
+    int saved_intr_state;
+
+    for (pp = &CURTHR->held_locks; *pp != lk; pp = &(*pp)->next)
+        assert (*pp != NULL);
+    
+    *pp = lk->next;
+    lk->owner = NULL;
+    lk->next = NULL;
+
+    saved_intr_state = intr_disable();
+
+    for (held = CURTHR->held_locks; held != NULL; held = held->next) {
+        for (thr = held->cond.wait_list.head; thr != NULL;
+            thr = thr->list_next)
+        {
+            if (prio_higher(pi_source(thr),
+                (donor != NULL) ? donor : CURTHR))
+            {
+                donor = pi_source(thr);
+            }
+        }
+    }
+
+    pi_set_donor(CURTHR, donor);
+    intr_restore(saved_intr_state);
+}
+
+void thread_tick(void) {
+    struct hart * const hart = &hart_tab[CURTHR->hart];
+    struct thread * thr;
+    int i;
+
+    for (i = 0; i < NSCHED; i++) {
+        thr = CURTHR;
+        if (thr == hart->idle_thread || sched_class_of(thr) != sched_classes[i])
+            thr = NULL;
+        sched_classes[i]->tick(hart, thr);
+    }
+}
+
+void thread_idle(void) {
+    struct hart * const hart = &hart_tab[CURTHR->hart];
+
+    // The idle thread sleeps using wfi if the ready lists are empty. Note that
+    // we need to disable interrupts before checking if the lists are empty to
+    // avoid a race condition where an ISR marks a thread ready to run between
+    // the check and the wfi instruction.
+
+    for (;;) {
+        // If there are runnable threads, yield to them. If this hart has none,
+        // take one from a hart that is busy.
+
+        while (sched_has_ready(hart) || steal_thread(hart))
+            thread_yield();
+        
+        // Use the idle time to zero free pages for the page allocator, one
+        // page at a time so that a newly ready thread does not wait long.
+
+        while (!sched_has_ready(hart) && memory_prezero_page())
+            continue;
+        
+        // No runnable threads. Sleep using the wfi instruction. Note that we
+        // need to disable interrupts and check the runnable thread list one
+        // more time (make sure it is empty) to avoid a race condition where an
+        // ISR marks a thread ready before we call the wfi instruction. Other
+        // harts may only touch our ready list once we release the kernel lock,
+        // and they send us an IPI when they do, which ends the wfi.
+
+        intr_disable();
+        if (!sched_has_ready(hart)) {
+            hart->idle = 1;
+            kernel_unlock();
+            asm ("wfi");
+            kernel_lock();
+            hart->idle = 0;
+        }
+        intr_enable();
+    }
+}
+
 void condition_init(struct condition * cond, const char * name) {
     cond->name = name;
     tlclear(&cond->wait_list);
@@ -471,18 +957,16 @@ void condition_broadcast(struct condition * cond) {
 
     saved_intr_state = intr_disable();
 
-    for (thr = cond->wait_list.head; thr != NULL; thr = thr->list_next) {
+    // Each thread goes back to the ready list of the hart it last ran on
+
+    while ((thr = tlremove(&cond->wait_list)) != NULL) {
         assert (thr->state == THREAD_WAITING);
         assert (thr->wait_cond == cond);
         set_thread_state(thr, THREAD_READY);
         thr->wait_cond = NULL;
+        ready_thread(thr, 1);
     }
 
-    // Append condition variable wait list to run list
-
-    tlappend(&ready_list, &cond->wait_list);
-    tlclear(&cond->wait_list);
-
     intr_restore(saved_intr_state);
 }
 
@@ -495,6 +979,7 @@ void init_main_thread(void) {
 
     main_thread.stack_base = _main_stack_anchor;
     main_thread.stack_size = _main_stack_anchor - _main_stack_lowest;
+    main_thread.sched = SCHED_CLASS(SCHED_DEFAULT);
 }
 
 void init_idle_thread(void) {
@@ -507,8 +992,31 @@ void init_idle_thread(void) {
     idle_thread.stack_base = _idle_stack_anchor;
     idle_thread.stack_size = _idle_stack_anchor - _idle_stack_lowest;
     _thread_setup(&idle_thread, _idle_stack_anchor, idle_thread_func);
-    tlinsert(&ready_list, &idle_thread); // interrupts still disabled
+}
+
 
+static void thread_ctor(void * obj) {
+    struct thread * const thr = obj;
+    struct thread_stack_anchor * stack_anchor;
+    void * stack_page;
+
+    memset(thr, 0, sizeof(struct thread));
+
+    stack_page = memory_alloc_page_unzeroed();
+    stack_anchor = stack_page + PAGE_SIZE;
+    stack_anchor -= 1;
+    stack_anchor->thread = thr;
+    stack_anchor->reserved = 0;
+
+    thr->stack_base = stack_anchor;
+    thr->stack_size = thr->stack_base - stack_page;
+    condition_init(&thr->child_exit, "child_exit");
+}
+
+static void thread_dtor(void * obj) {
+    struct thread * const thr = obj;
+
+    memory_free_page(thr->stack_base - thr->stack_size);
 }
 
 static void set_running_thread(struct thread * thr) {
@@ -546,61 +1054,456 @@ void recycle_thread(int tid) {
     }
 
     thrtab[tid] = NULL;
-    kfree(thr);
+    kmem_cache_free(&thread_cache, thr);
 }
 
 void suspend_self(void) {
     struct thread * susp_thread; // suspending thread
     struct thread * next_thread; // resuming thread
-    struct thread * prev_thread; // previously thread
+    struct hart * hart;
     int saved_intr_state;
+    int migrated;
 
     trace("%s() in %s", __func__, CURTHR->name);
 
-    // The idle thread is always runnable, and the idle thread only calls
-    // suspend_self() if the ready_list is not empty.
-
-    assert (!tlempty(&ready_list));
-
     susp_thread = CURTHR;
-
-    // Get a READY thread from the ready list and mark it running
+    hart = &hart_tab[susp_thread->hart];
 
     saved_intr_state = intr_disable();
 
-    next_thread = tlremove(&ready_list);
-    assert(next_thread->state == THREAD_READY);
-    set_thread_state(next_thread, THREAD_RUNNING);
-    
     // If the current thread is still running, mark it ready-to-run and put it
-    // in the back of the ready-to-run list.
+    // back on the hart's ready lists. Its scheduling class decides whether it
+    // runs again before the others.
+
+    if (susp_thread != hart->idle_thread &&
+        sched_class_of(susp_thread)->stop != NULL)
+    {
+        sched_class_of(susp_thread)->stop(hart, susp_thread);
+    }
 
     if (susp_thread->state == THREAD_RUNNING) {
         set_thread_state(susp_thread, THREAD_READY);
-        tlinsert(&ready_list, susp_thread);
+        if (susp_thread != hart->idle_thread)
+            sched_enqueue(hart, susp_thread, 0);
+    }
+
+    // Get the next thread to run and mark it running. If there is none, resume
+    // the idle thread. The current thread may be the one to keep running.
+
+    next_thread = sched_dequeue_next(hart, 0);
+
+    if (next_thread == NULL)
+        next_thread = hart->idle_thread;
+
+    assert(next_thread->state == THREAD_READY);
+    set_thread_state(next_thread, THREAD_RUNNING);
+
+    if (next_thread == susp_thread) {
+        intr_restore(saved_intr_state);
+        return;
     }
 
+    // A thread taken from another hart's ready list moves to this hart
+
+    migrated = (next_thread->hart != susp_thread->hart);
+    next_thread->hart = susp_thread->hart;
+    hart->curr = next_thread;
+
     intr_enable();
 
-    if (next_thread->proc != NULL)
+    // Kernel threads run in the main memory space, as the memory space of the
+    // previous thread may be reclaimed on another hart while they run. A
+    // memory space that was last active on another hart may have been changed
+    // there, so drop whatever this hart still caches of it.
+
+    if (next_thread->proc != NULL) {
         memory_space_switch(next_thread->proc->mtag);
+        if (migrated)
+            memory_space_flush(next_thread->proc->mtag);
+    } else
+        memory_space_switch(main_mtag);
 
     trace("Thread <%s> calling _thread_swtch(<%s>)",
         CURTHR->name, next_thread->name);
     
-    prev_thread = _thread_swtch(next_thread);
+    _thread_swtch(next_thread);
 
     trace("_thread_swtch() returned in %s", CURTHR->name);
 
     // kprintf("switched to thread: %s\n", CURTHR->name);
 
-    if (prev_thread->state == THREAD_EXITED) {
-        memory_free_page(prev_thread->stack_base - PAGE_SIZE);
-        prev_thread->stack_base = NULL;
-        prev_thread->stack_size = 0;
+    intr_restore(saved_intr_state);
+}
+
+void ready_thread(struct thread * thr, int wakeup) {
+    const int self = CURTHR->hart;
+    int hartid;
+
+    sched_enqueue(&hart_tab[thr->hart], thr, wakeup);
+
+    // Clear the idle flag of the hart we wake, so that the next thread made
+    // ready wakes a different one.
+
+    if (thr->hart != self && hart_tab[thr->hart].idle) {
+        hart_tab[thr->hart].idle = 0;
+        smp_send_ipi(thr->hart);
+        return;
     }
 
+    // If the thread outranks the one running on its hart, interrupt that hart.
+    // Threads of pinned classes, e.g. EDF, would otherwise wait for its next
+    // tick, as no other hart may take them.
+
+    if (thr->hart != self && hart_tab[thr->hart].curr != NULL &&
+        prio_higher(pi_source(thr), pi_source(hart_tab[thr->hart].curr)))
+    {
+        smp_send_ipi(thr->hart);
+        return;
+    }
+
+    for (hartid = 0; hartid < NHART; hartid++) {
+        if (hartid != self && hart_tab[hartid].idle) {
+            hart_tab[hartid].idle = 0;
+            smp_send_ipi(hartid);
+            return;
+        }
+    }
+}
+
+int steal_thread(struct hart * hart) {
+    struct thread * thr = NULL;
+    int saved_intr_state;
+    int hartid;
+
+    saved_intr_state = intr_disable();
+
+    for (hartid = 0; hartid < NHART && thr == NULL; hartid++) {
+        if (&hart_tab[hartid] != hart)
+            thr = sched_dequeue_next(&hart_tab[hartid], 1);
+    }
+    
+    if (thr != NULL)
+        sched_enqueue(hart, thr, 0);
+
     intr_restore(saved_intr_state);
+    return (thr != NULL);
+}
+
+void sched_enqueue(struct hart * hart, struct thread * thr, int wakeup) {
+    assert (thr->state == THREAD_READY);
+
+    thr->queued_hart = hart - hart_tab;
+    sched_class_of(thr)->enqueue(hart, thr, wakeup);
+}
+
+struct thread * sched_dequeue_next(struct hart * hart, int steal) {
+    struct thread * thr;
+    int i;
+
+    for (i = 0; i < NSCHED; i++) {
+        if (steal && sched_classes[i]->pinned)
+            continue;
+
+        thr = sched_classes[i]->pick_next(hart);
+
+        if (thr != NULL) {
+            sched_classes[i]->dequeue(hart, thr);
+            return thr;
+        }
+    }
+
+    return NULL;
+}
+
+int sched_has_ready(struct hart * hart) {
+    int i;
+
+    for (i = 0; i < NSCHED; i++) {
+        if (sched_classes[i]->pick_next(hart) != NULL)
+            return 1;
+    }
+
+    return 0;
+}
+
+void fifo_enqueue(struct hart * hart, struct thread * thr, int wakeup) {
+    tlinsert(&hart->ready_list, thr);
+}
+
+struct thread * fifo_pick_next(struct hart * hart) {
+    return hart->ready_list.head;
+}
+
+void fifo_dequeue(struct hart * hart, struct thread * thr) {
+    const int found = tlremove_thread(&hart->ready_list, thr);
+
+    assert (found);
+}
+
+void fifo_tick(struct hart * hart, struct thread * thr) {
+    // nothing to do
+}
+
+void mlfq_enqueue(struct hart * hart, struct thread * thr, int wakeup) {
+    // A thread that blocked before using up its allotment moves up a level,
+    // with a fresh allotment.
+
+    if (wakeup && thr->sched == &sched_mlfq) {
+        if (0 < thr->sched_level)
+            thr->sched_level -= 1;
+        thr->sched_ticks = 0;
+    }
+
+    tlinsert(&hart->mlfq_list[pi_source(thr)->sched_level], thr);
+}
+
+struct thread * mlfq_pick_next(struct hart * hart) {
+    int level;
+
+    for (level = 0; level < MLFQ_NLEVEL; level++) {
+        if (!tlempty(&hart->mlfq_list[level]))
+            return hart->mlfq_list[level].head;
+    }
+
+    return NULL;
+}
+
+// The level of a boosted thread's donor may have changed since the thread was
+// put on a list (mlfq_boost), so look for it on every level.
+
+void mlfq_dequeue(struct hart * hart, struct thread * thr) {
+    int level;
+
+    for (level = 0; level < MLFQ_NLEVEL; level++) {
+        if (tlremove_thread(&hart->mlfq_list[level], thr))
+            return;
+    }
+
+    panic("thread not on MLFQ ready list");
+}
+
+// The running thread is charged for the tick. A thread is not demoted for
+// yielding, so it cannot stay at its level by yielding just before a tick.
+
+void mlfq_tick(struct hart * hart, struct thread * thr) {
+    if (thr != NULL) {
+        thr->sched_ticks += 1;
+
+        if ((MLFQ_ALLOT << thr->sched_level) <= thr->sched_ticks) {
+            if (thr->sched_level < MLFQ_NLEVEL-1)
+                thr->sched_level += 1;
+            thr->sched_ticks = 0;
+        }
+    }
+
+    // Hart 0 ticks even when it is idle, so it keeps time for the boost
+
+    if (hart == &hart_tab[0] && --mlfq_boost_ticks == 0) {
+        mlfq_boost_ticks = MLFQ_BOOST_TICKS;
+        mlfq_boost();
+    }
+}
+
+// Moves all threads of the MLFQ class to the top level, including the ones
+// that are running or waiting on another hart. This is safe as we hold the
+// kernel lock.
+
+void mlfq_boost(void) {
+    struct thread * thr;
+    int hartid;
+    int level;
+    int tid;
+
+    for (tid = 0; tid < NTHR; tid++) {
+        thr = thrtab[tid];
+        if (thr != NULL && thr->sched == &sched_mlfq) {
+            thr->sched_level = 0;
+            thr->sched_ticks = 0;
+        }
+    }
+
+    for (hartid = 0; hartid < NHART; hartid++) {
+        for (level = 1; level < MLFQ_NLEVEL; level++) {
+            while ((thr = tlremove(&hart_tab[hartid].mlfq_list[level])) != NULL)
+                tlinsert(&hart_tab[hartid].mlfq_list[0], thr);
+        }
+    }
+}
+
+// A thread that is out of budget waits on edf_throttled for its next period.
+// One woken up with a deadline it can no longer meet with the budget it has
+// left, without using more than its share of the hart, gets a new period.
+
+void edf_enqueue(struct hart * hart, struct thread * thr, int wakeup) {
+    uint64_t now;
+
+    // A boosted thread runs with its donor's deadline and is not throttled
+
+    if (thr->pi_donor != NULL) {
+        edf_insert(&hart->edf_list, thr);
+        return;
+    }
+
+    if (wakeup) {
+        now = timer_get_time();
+
+        if (thr->rt_deadline <= now || (!thr->rt_throttled &&
+            (thr->rt_deadline - now) * thr->rt_runtime <
+            thr->rt_budget * thr->rt_period))
+        {
+            thr->rt_deadline = now + thr->rt_period;
+            thr->rt_budget = thr->rt_runtime;
+            thr->rt_throttled = 0;
+        }
+    }
+
+    if (thr->rt_throttled)
+        edf_insert(&hart->edf_throttled, thr);
+    else
+        edf_insert(&hart->edf_list, thr);
+}
+
+struct thread * edf_pick_next(struct hart * hart) {
+    return hart->edf_list.head;
+}
+
+void edf_dequeue(struct hart * hart, struct thread * thr) {
+    const int found = tlremove_thread(&hart->edf_list, thr) ||
+        tlremove_thread(&hart->edf_throttled, thr);
+
+    assert (found);
+    thr->rt_start = timer_get_time();
+}
+
+// Only threads of the class have a budget. Others may be here by inheriting
+// the priority of an EDF thread.
+
+void edf_stop(struct hart * hart, struct thread * thr) {
+    if (thr->sched == &sched_edf)
+        edf_charge(thr, timer_get_time());
+}
+
+// Charges the running thread, and gives throttled threads whose period is over
+// a new period, starting now, with a full budget. The running thread may
+// overrun its budget by up to a tick before it is throttled.
+
+void edf_tick(struct hart * hart, struct thread * thr) {
+    const uint64_t now = timer_get_time();
+
+    if (thr != NULL && thr->sched == &sched_edf)
+        edf_charge(thr, now);
+
+    while (hart->edf_throttled.head != NULL &&
+        hart->edf_throttled.head->rt_deadline <= now)
+    {
+        thr = tlremove(&hart->edf_throttled);
+        thr->rt_deadline = now + thr->rt_period;
+        thr->rt_budget = thr->rt_runtime;
+        thr->rt_throttled = 0;
+        edf_insert(&hart->edf_list, thr);
+    }
+}
+
+void edf_charge(struct thread * thr, uint64_t now) {
+    thr->rt_budget -= now - thr->rt_start;
+    thr->rt_start = now;
+
+    if (thr->rt_budget <= 0 && thr->pi_donor == NULL)
+        thr->rt_throttled = 1;
+}
+
+// Inserts /thr/ into a list of EDF threads sorted by deadline, after the
+// threads with the same deadline. A boosted thread has its donor's deadline.
+
+void edf_insert(struct thread_list * list, struct thread * thr) {
+    const uint64_t deadline = pi_source(thr)->rt_deadline;
+    struct thread * prev;
+
+    if (list->head == NULL || deadline < pi_source(list->head)->rt_deadline) {
+        thr->list_next = list->head;
+        list->head = thr;
+        if (list->tail == NULL)
+            list->tail = thr;
+        return;
+    }
+
+    prev = list->head;
+    while (prev->list_next != NULL &&
+        pi_source(prev->list_next)->rt_deadline <= deadline)
+    {
+        prev = prev->list_next;
+    }
+
+    thr->list_next = prev->list_next;
+    prev->list_next = thr;
+    if (list->tail == prev)
+        list->tail = thr;
+}
+
+// Moves the running thread /thr/ from the EDF class to the default class and
+// gives back its share of the hart.
+
+void edf_leave(struct thread * thr) {
+    struct hart * const hart = &hart_tab[thr->hart];
+
+    assert (thr == CURTHR);
+
+    hart->edf_util -= thr->rt_runtime * EDF_UTIL_ONE / thr->rt_period;
+    thr->sched = SCHED_CLASS(SCHED_DEFAULT);
+    thr->sched_level = 0;
+    thr->sched_ticks = 0;
+}
+
+static inline struct thread * pi_source(struct thread * thr) {
+    return (thr->pi_donor != NULL) ? thr->pi_donor : thr;
+}
+
+static inline const struct sched_class * sched_class_of(struct thread * thr) {
+    return pi_source(thr)->sched;
+}
+
+int prio_higher(const struct thread * a, const struct thread * b) {
+    int arank, brank;
+
+    for (arank = 0; arank < NSCHED; arank++)
+        if (sched_classes[arank] == a->sched)
+            break;
+    
+    for (brank = 0; brank < NSCHED; brank++)
+        if (sched_classes[brank] == b->sched)
+            break;
+    
+    if (arank != brank)
+        return (arank < brank);
+    else if (a->sched == &sched_mlfq)
+        return (a->sched_level < b->sched_level);
+    else if (a->sched == &sched_edf)
+        return (a->rt_deadline < b->rt_deadline);
+    else
+        return 0;
+}
+
+// A READY thread is found on the hart it was queued on. That is not
+// thr->hart if another hart has stolen it and not yet run it.
+
+void pi_set_donor(struct thread * thr, struct thread * donor) {
+    struct hart * const hart = &hart_tab[thr->queued_hart];
+    const int queued =
+        (thr->state == THREAD_READY && thr->id != IDLE_TID);
+
+    if (thr->pi_donor == donor)
+        return;
+
+    debug("Thread <%s> inherits priority of <%s>",
+        thr->name, (donor != NULL) ? donor->name : thr->name);
+
+    if (queued)
+        sched_class_of(thr)->dequeue(hart, thr);
+
+    thr->pi_donor = donor;
+
+    if (queued)
+        sched_class_of(thr)->enqueue(hart, thr, 0);
 }
 
 void tlclear(struct thread_list * list) {
@@ -648,47 +1551,34 @@ struct thread * tlremove(struct thread_list * list) {
     return thr;
 }
 
-// Appends elements of l1 to the end of l0 and clears l1.
+// Removes /thr/ from anywhere in /list/. Returns 1 if it was on the list.
 
-void tlappend(struct thread_list * l0, struct thread_list * l1) {
-    if (l0->head != NULL) {
-        assert(l0->tail != NULL);
-        
-        if (l1->head != NULL) {
-            assert(l1->tail != NULL);
-            l0->tail->list_next = l1->head;
-            l0->tail = l1->tail;
-        }
-    } else {
-        assert(l0->tail == NULL);
-        l0->head = l1->head;
-        l0->tail = l1->tail;
+int tlremove_thread(struct thread_list * list, struct thread * thr) {
+    struct thread * prev = NULL;
+    struct thread * cur;
+
+    for (cur = list->head; cur != NULL; cur = cur->list_next) {
+        if (cur == thr)
+            break;
+        prev = cur;
     }
 
-    l1->head = NULL;
-    l1->tail = NULL;
-}
+    if (cur == NULL)
+        return 0;
 
-void idle_thread_func(void * arg __attribute__ ((unused))) {
-    // The idle thread sleeps using wfi if the ready list is empty. Note that we
-    // need to disable interrupts before checking if the thread list is empty to
-    // avoid a race condition where an ISR marks a thread ready to run between
-    // the call to tlempty() and the wfi instruction.
+    if (prev != NULL)
+        prev->list_next = thr->list_next;
+    else
+        list->head = thr->list_next;
 
-    for (;;) {
-        // If there are runnable threads, yield to them.
+    if (list->tail == thr)
+        list->tail = prev;
 
-        while (!tlempty(&ready_list))
-            thread_yield();
-        
-        // No runnable threads. Sleep using the wfi instruction. Note that we
-        // need to disable interrupts and check the runnable thread list one
-        // more time (make sure it is empty) to avoid a race condition where an
-        // ISR marks a thread ready before we call the wfi instruction.
+    thr->list_next = NULL;
+    return 1;
+}
 
-        intr_disable();
-        if (tlempty(&ready_list))
-            asm ("wfi");
-        intr_enable();
-    }
+
+void idle_thread_func(void * arg __attribute__ ((unused))) {
+    thread_idle();
 }
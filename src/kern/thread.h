@@ -5,9 +5,11 @@
 #define _THREAD_H_
 
 #include "trap.h"
+#include "memory.h"
 #include <stddef.h>
 
 struct thread; // forward decl.
+struct lock; // lock.h
 
 struct thread_stack_anchor {
     struct thread * thread;
@@ -34,6 +36,10 @@ struct process {
     int tid; // thread id of associated thread
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX];
+    struct mem_region regions[MEMORY_REGION_MAX]; // demand-paged user memory
+    size_t rss; // user pages mapped in the memory space (kept by memory.c)
+    size_t minflt; // page faults resolved without I/O
+    size_t majflt; // page faults that read from swap or a file
 };
 
 // EXPORTED GLOBAL VARIABLES
@@ -51,6 +57,58 @@ extern void thread_init(void);
 
 int running_thread(void);
 
+// int running_hart(void)
+// Returns the id of the hart the current thread is running on.
+
+extern int running_hart(void);
+
+// struct thread_stack_anchor * thread_create_idle(int hartid)
+// Creates the idle thread of hart /hartid/, which must not be hart 0, and
+// returns the anchor of its stack. The hart starts out running as this thread
+// (see smp.c) and enters its idle loop by calling thread_idle.
+
+extern struct thread_stack_anchor * thread_create_idle(int hartid);
+
+// void thread_idle(void)
+// Runs the idle loop of the current hart, which runs the threads on the
+// hart's ready list, takes threads from the ready lists of other harts when it
+// has none, and otherwise waits for an interrupt. Does not return.
+
+extern void thread_idle(void) __attribute__ ((noreturn));
+
+// void thread_tick(void)
+// Called from the timer interrupt handler on each tick of the current hart.
+// Lets the scheduling classes charge the running thread for the tick.
+
+extern void thread_tick(void);
+
+// int thread_reserve(unsigned long runtime_us, unsigned long period_us)
+// Moves the current thread to the EDF scheduling class with a reservation of
+// /runtime_us/ microseconds of CPU time every /period_us/ microseconds, or
+// back to the default class if /runtime_us/ is 0. The thread then stays on
+// the hart it is running on. Returns 0 on success, -EINVAL if the reservation
+// is invalid, or -EBUSY if the hart cannot fit it alongside the reservations
+// it already has.
+
+extern int thread_reserve(unsigned long runtime_us, unsigned long period_us);
+
+// void thread_lock_wait(struct lock * lk)
+// void thread_lock_acquired(struct lock * lk)
+// void thread_lock_released(struct lock * lk)
+// Priority inheritance for struct lock (see lock.h). thread_lock_wait waits
+// for /lk/ to be released, first passing the priority of the current thread
+// on to the owner of the lock, and on along the chain of owners that are
+// waiting for locks of their own. thread_lock_acquired records that the
+// current thread holds /lk/ and is its owner. The owner is kept as a thread
+// rather than a thread ID, as the idle threads of all harts share one ID.
+// thread_lock_released forgets it, and lowers the current thread's priority
+// to that of the highest-priority thread still waiting for a lock it holds,
+// or to its own.
+
+extern void thread_lock_wait(struct lock * lk);
+extern void thread_lock_acquired(struct lock * lk);
+extern void thread_lock_released(struct lock * lk);
+
 // int thread_spawn(const char * name, void (*start)(void *), void * arg)
 // Creates and starts a new thread. Argument /name/ is the name of the thread
 // (optional, may be NULL), /start/ is the thread entry point, and /arg/ is an
@@ -122,8 +180,9 @@ extern void condition_wait(struct condition * cond);
 // Wakes up all threads waiting on a condition. This function may be called from
 // an ISR. Calling condition_broadcast() does not cause a context switch from
 // the currently running thread.
-// Waiting threads are added to the ready-to-run list in the order they were
-// added to the wait queue.
+// Waiting threads are added to the ready-to-run list of the hart they last ran
+// on in the order they were added to the wait queue, and an idle hart is woken
+// to run them.
 
 extern void condition_broadcast(struct condition * cond);
 
@@ -6,6 +6,7 @@
 #include "csr.h"
 #include "intr.h"
 #include "halt.h" // for assert
+#include "sync.h"
 
 #include "config.h"
 #include <limits.h>
@@ -32,6 +33,12 @@ char timer_initialized = 0;
 static struct alarm * sleep_list;
 static uint64_t next_tick;
 
+// Writers of sleep_list go through sleep_seqlock, so that the timer interrupt
+// handler can look at the head of the list without taking the lock when no
+// alarm is due, which is almost always.
+
+static struct seqlock sleep_seqlock;
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -41,11 +48,13 @@ static inline uint64_t get_mtime(void);
 static inline void set_mtime(uint64_t val);
 static inline uint64_t get_mtcmp(void);
 static inline void set_mtcmp(uint64_t val);
+static inline void set_hart_mtcmp(int hartid, uint64_t val);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
 
 void timer_init(void) {
+    seqlock_init(&sleep_seqlock, "sleep_list");
     set_mtime(0);
     set_mtcmp(TICK_PERIOD);
     csrs_sie(RISCV_SIE_STIE);
@@ -54,6 +63,12 @@ void timer_init(void) {
     timer_initialized = 1;
 }
 
+void timer_init_hart(void) {
+    set_hart_mtcmp(running_hart(), get_mtime() + TICK_PERIOD);
+    csrs_sie(RISCV_SIE_STIE);
+    enable_mmode_timer_intr();
+}
+
 void alarm_init(struct alarm * al, const char * name) {
     condition_init(&al->cond, name ? name : "alarm");
     al->twake = get_mtime();
@@ -63,6 +78,7 @@ void alarm_init(struct alarm * al, const char * name) {
 void alarm_sleep(struct alarm * al, uint64_t tcnt) {
     struct alarm * prev;
     int saved_intr_state;
+    int saved_seq_state;
     uint64_t now;
 
     now = get_mtime();
@@ -80,18 +96,24 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
         return;
     
     saved_intr_state = intr_disable();
+    saved_seq_state = seqlock_write_begin(&sleep_seqlock);
 
     if (sleep_list == NULL || al->twake <= sleep_list->twake) {
         debug("[%lu] Inserting alarm %s at head of list", now, al->cond.name);
         // Insert alarm at head of sleep list
         al->next = sleep_list;
         sleep_list = al;
-        // If current alarm occurs before next tick, update mtcmp
+        // If current alarm occurs before next tick, update mtcmp. The sleep
+        // list belongs to the timer of hart 0. When called on another hart,
+        // there is no need to re-arm it: it is only disarmed while its
+        // interrupt is pending, and the handler will see the new alarm.
 
         if (al->twake < next_tick) {
             set_mtcmp(al->twake);
-            csrs_sie(RISCV_SIE_STIE);
-            enable_mmode_timer_intr();
+            if (running_hart() == 0) {
+                csrs_sie(RISCV_SIE_STIE);
+                enable_mmode_timer_intr();
+            }
         }
 
 
@@ -120,6 +142,8 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
         }
     }
 
+    seqlock_write_end(&sleep_seqlock, saved_seq_state);
+
     debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
 
     // Note: condition_wait must be *inside* intr_disable/intr_restore block to
@@ -138,33 +162,82 @@ void alarm_reset(struct alarm * al) {
     al->twake = get_mtime();
 }
 
+uint64_t timer_get_time(void) {
+    return get_mtime();
+}
+
 // timer_handle_interrupt() is dispatched from intr_handler in intr.c
 
 void timer_intr_handler(struct trap_frame * tfr) {
-    struct alarm * head = sleep_list;
+    struct alarm * expired = NULL;
+    struct alarm * last;
+    struct alarm * head;
     struct alarm * next;
+    int saved_seq_state;
+    uint64_t twake;
+    uint32_t seq;
     uint64_t now;
 
     now = get_mtime();
 
     trace("[%lu] %s()", now, __func__);
+
+    // Harts other than hart 0 only get a tick for time slicing
+
+    if (running_hart() != 0) {
+        set_hart_mtcmp(running_hart(), now + TICK_PERIOD);
+        enable_mmode_timer_intr();
+        thread_tick();
+        return;
+    }
     debug("[%lu] mtcmp = %lu", now, get_mtcmp());
 
-    while (head != NULL && head->twake <= now) {
-        debug("[%lu] Broadcasting alarm for %s", now, head->cond.name);
-        condition_broadcast(&head->cond);
-        next = head->next;
-        head->next = NULL;
-        head = next;
+    do {
+        seq = seqlock_read_begin(&sleep_seqlock);
+        head = sleep_list;
+        twake = (head != NULL) ? head->twake : UINT64_MAX;
+    } while (seqlock_read_retry(&sleep_seqlock, seq));
+
+    // Take the alarms that are due off the list, then wake them up
+
+    if (twake <= now) {
+        saved_seq_state = seqlock_write_begin(&sleep_seqlock);
+
+        expired = sleep_list;
+        last = NULL;
+
+        for (head = sleep_list; head != NULL && head->twake <= now;
+            head = head->next)
+        {
+            last = head;
+        }
+
+        if (last != NULL)
+            last->next = NULL;
+        else
+            expired = NULL;
+        
+        sleep_list = head;
+        twake = (head != NULL) ? head->twake : UINT64_MAX;
+
+        seqlock_write_end(&sleep_seqlock, saved_seq_state);
     }
 
-    if (next_tick < now)
-        next_tick += TICK_PERIOD;
+    while (expired != NULL) {
+        debug("[%lu] Broadcasting alarm for %s", now, expired->cond.name);
+        next = expired->next;
+        expired->next = NULL;
+        condition_broadcast(&expired->cond);
+        expired = next;
+    }
 
-    sleep_list = head;
+    if (next_tick < now) {
+        next_tick += TICK_PERIOD;
+        thread_tick();
+    }
 
-    if (head != NULL && head->twake < next_tick)
-        set_mtcmp(head->twake);
+    if (twake < next_tick)
+        set_mtcmp(twake);
     else
         set_mtcmp(next_tick);
 
@@ -197,3 +270,9 @@ static inline uint64_t get_mtcmp(void) {
 static inline void set_mtcmp(uint64_t val) {
     *(volatile uint64_t*)MTCMP_ADDR = val;
 }
+
+// Each hart has its own mtimecmp register, following that of hart 0
+
+static inline void set_hart_mtcmp(int hartid, uint64_t val) {
+    *(volatile uint64_t*)(MTCMP_ADDR + 8UL * hartid) = val;
+}
@@ -22,6 +22,11 @@ struct alarm {
 extern char timer_initialized;
 extern void timer_init(void);
 
+// Starts the timer tick on a hart other than hart 0. Only hart 0 wakes up
+// sleeping threads; the others only use the tick for time slicing.
+
+extern void timer_init_hart(void);
+
 // Initializes an alarm. The /name/ argument is optional.
 
 extern void alarm_init(struct alarm * al, const char * name);
@@ -37,6 +42,10 @@ extern void alarm_sleep(struct alarm * al, uint64_t tcnt);
 
 extern void alarm_reset(struct alarm * al);
 
+// Returns the current time in timer ticks (TIMER_FREQ per second)
+
+extern uint64_t timer_get_time(void);
+
 extern void timer_intr_handler(struct trap_frame * tfr); // called from intr.c
 
 static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec);
@@ -170,6 +170,11 @@ _trap_entry_from_umode:
         la t6, _trap_entry_from_smode
         csrw stvec, t6
 
+        # Kernel code only runs on the hart that holds the kernel lock (see
+        # smp.c). Interrupts are still disabled here.
+
+        call kernel_lock
+
         call trap_umode_cont
 
         # U mode handlers return here because the call instruction above places
@@ -179,6 +184,12 @@ _trap_entry_from_umode:
 
         # TODO: FIXME your code here
 
+        # Release the kernel lock with interrupts disabled, so that none is
+        # taken in S mode without it before we sret.
+
+        csrci sstatus, 2 # SIE
+        call kernel_unlock
+
         la t6, _trap_entry_from_umode
         csrw stvec, t6
 
@@ -229,53 +240,76 @@ trap_umode_cont:
 #   3. When a M mode timer interrupt occurs, we set STIP and clear MTIE. S mode
 #      then needs to re-arm timer interrupts using (2).
 #
+# Machine software interrupts are IPIs from other harts (see smp.c). We clear
+# them in the CLINT and pass them on to S mode by setting SSIP.
+#
+# mscratch points to a two-doubleword save area of the hart (set up in
+# start.s), in which we save t1 and t2.
 
 _mmode_trap_entry:
-        # Stash t0 away in mscratch
+        # Swap t0 with mscratch, then save t1 and t2
+
+        csrrw   t0, mscratch, t0
+        sd      t1, 0*8(t0)
+        sd      t2, 1*8(t0)
 
-        csrw    mscratch, t0
+        csrr    t1, mcause
+        bgez    t1, mmode_excp_handler
 
-        csrr    t0, mcause
-        bgez    t0, mmode_excp_handler
+        # Timer interrupt or IPI, otherwise panic
 
-        # If it's not a timer interrupt, panic
+        slli    t1, t1, 1       # clear msb
+        srli    t1, t1, 1       #
+        addi    t2, t1, -7
+        beqz    t2, mmode_timer_intr
+        addi    t2, t1, -3
+        bnez    t2, unexpected_mmode_trap
 
-        addi    t0, t0, -7      # subtract 7
-        slli    t0, t0, 1       # clear msb
-        bnez    t0, unexpected_mmode_trap
+        # Clear our msip, set SSIP
+
+        csrr    t1, mhartid
+        slli    t1, t1, 2
+        li      t2, 0x2000000   # CLINT msip of hart 0
+        add     t1, t1, t2
+        sw      zero, 0(t1)
+        li      t1, 0x2         # SSIP
+        csrs    mip, t1
+        j       mmode_trap_done
 
-mmode_intr_handler:
+mmode_timer_intr:
 
         # Set STIP, clear MTIE
 
-        li      t0, 0x20        # STIP
-        csrs    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrc    mie, t0
+        li      t1, 0x20        # STIP
+        csrs    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrc    mie, t1
         j       mmode_trap_done
 
 mmode_excp_handler:
         # We support one S mode to M mode environment call, which is to re-arm
         # the timer interrupt.
 
-        addi    t0, t0, -9
-        bnez    t0, unexpected_mmode_trap
+        addi    t1, t1, -9
+        bnez    t1, unexpected_mmode_trap
 
         # Clear STIP, set MTIE
 
-        li      t0, 0x20        # STIP
-        csrc    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrs    mie, t0
+        li      t1, 0x20        # STIP
+        csrc    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrs    mie, t1
 
         # Advance mepc past ecall instruction
 
-        csrr    t0, mepc
-        addi    t0, t0, 4
-        csrw    mepc, t0
+        csrr    t1, mepc
+        addi    t1, t1, 4
+        csrw    mepc, t1
        
 mmode_trap_done:
-        csrr    t0, mscratch
+        ld      t2, 1*8(t0)
+        ld      t1, 0*8(t0)
+        csrrw   t0, mscratch, t0
         mret
 
 
@@ -0,0 +1,533 @@
+// vioballoon.c - VirtIO memory balloon
+//
+// The host sets a target balloon size in the device config space. A driver
+// thread inflates the balloon by taking free pages from the page allocator and
+// telling the device their page frame numbers, or deflates it by doing the
+// reverse. When the page allocator runs out of memory it asks the driver to
+// deflate (see memory_balloon_init) before swapping anything out. This needs
+// the DEFLATE_ON_OOM feature, which QEMU only offers with deflate-on-oom=on
+// (see QEMUOPTS in the Makefile). Free memory statistics are reported on the
+// stats queue whenever the host asks for them.
+//
+
+#ifdef VIOBALLOON_TRACE
+#define TRACE
+#endif
+
+#ifdef VIOBALLOON_DEBUG
+#define DEBUG
+#endif
+
+#include "virtio.h"
+#include "intr.h"
+#include "halt.h"
+#include "heap.h"
+#include "memory.h"
+#include "console.h"
+#include "thread.h"
+#include "lock.h"
+#include "config.h"
+#include "string.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+#define VIOBALLOON_IRQ_PRIO 1
+
+// Maximum number of page frame numbers sent to the device in one request
+
+#define VIOBALLOON_BATCH 256
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// VirtIO balloon device feature bits (number, *not* mask)
+
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST     0
+#define VIRTIO_BALLOON_F_STATS_VQ           1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM     2
+
+// Virtqueues
+
+#define VIOBALLOON_INFLATEQ 0
+#define VIOBALLOON_DEFLATEQ 1
+#define VIOBALLOON_STATSQ   2
+#define VIOBALLOON_NQ       3
+
+// Statistics tags (struct virtio_balloon_stat)
+
+#define VIRTIO_BALLOON_S_MEMFREE    4
+#define VIRTIO_BALLOON_S_MEMTOT     5
+#define VIRTIO_BALLOON_S_AVAIL      6
+
+#define VIOBALLOON_NSTAT 3
+
+// Interrupt status bits
+
+#define VIRTIO_INT_USED     (1 << 0)
+#define VIRTIO_INT_CONFIG   (1 << 1)
+
+// Page frame numbers given to the device are always in 4 KB units
+
+#define VIRTIO_BALLOON_PFN_SHIFT 12
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct virtio_balloon_stat {
+    uint16_t tag;
+    uint64_t val;
+} __attribute__ ((packed));
+
+// Pages in the balloon are recorded in a stack of chunks, each of which takes
+// up one page. The page frame number arrays double as request buffers.
+
+#define VIOBALLOON_CHUNK_LEN \
+    ((PAGE_SIZE - 2 * sizeof(void *)) / sizeof(uint32_t))
+
+struct vioballoon_chunk {
+    struct vioballoon_chunk * next;
+    size_t cnt;
+    uint32_t pfns[VIOBALLOON_CHUNK_LEN];
+};
+
+// Each virtqueue has a single descriptor, so there is at most one request
+// outstanding on each queue.
+
+struct vioballoon_vq {
+    struct virtq_desc desc[1];
+
+    union {
+        struct virtq_avail avail;
+        char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
+    };
+
+    union {
+        volatile struct virtq_used used;
+        char _used_filler[VIRTQ_USED_SIZE(1)];
+    };
+} __attribute__ ((aligned(16)));
+
+struct vioballoon_device {
+    volatile struct virtio_mmio_regs * regs;
+    uint16_t irqno;
+    int8_t tell_host; // deflated pages must be reported before reuse
+    int8_t has_stats; // stats queue negotiated
+
+    // Set by the ISR for the driver thread
+    int8_t config_changed;
+    int8_t stats_wanted;
+
+    // Signaled from ISR
+    struct condition used_updated; // inflate or deflate request done
+    struct condition work; // config_changed or stats_wanted set
+
+    // Held while pages are moved in or out of the balloon
+    struct lock lock;
+
+    struct vioballoon_vq vq[VIOBALLOON_NQ];
+
+    struct vioballoon_chunk * chunks;
+    size_t page_cnt; // pages in the balloon
+
+    struct virtio_balloon_stat stats[VIOBALLOON_NSTAT];
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Only one balloon device is used, as memory.c has a single deflate hook
+
+static struct vioballoon_device * balloon;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void vioballoon_isr(int irqno, void * aux);
+static void vioballoon_thread(void * aux);
+static size_t vioballoon_oom_deflate(size_t cnt);
+
+static size_t vioballoon_inflate(struct vioballoon_device * dev, size_t cnt);
+static size_t vioballoon_deflate(struct vioballoon_device * dev, size_t cnt);
+
+static void vioballoon_send (
+    struct vioballoon_device * dev, int qid, void * buf, uint32_t len);
+
+static void vioballoon_post_stats(struct vioballoon_device * dev);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * Name: vioballoon_attach
+ *
+ * Inputs:
+ *  volatile struct virtio_mmio_regs*   -> regs
+ *  int                                 -> irqno
+ *
+ * Outputs:
+ *  void
+ *
+ * Purpose:
+ *  Initializes a VirtIO balloon device: negotiates features, attaches the
+ *  inflate, deflate and (if offered) stats virtqueues, registers the ISR and
+ *  starts the driver thread that tracks the host's target balloon size.
+ *
+ * Side effects:
+ *  Allocates kernel memory, enables interrupts for the device and registers a
+ *  deflate hook with the page allocator. Declared and called directly from
+ *  virtio.c.
+ */
+void vioballoon_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
+    virtio_featset_t enabled_features, wanted_features, needed_features;
+    struct vioballoon_device * dev;
+    int result;
+    int q;
+
+    assert (regs->device_id == VIRTIO_ID_BALLOON);
+
+    if (balloon != NULL) {
+        kprintf("%p: Second virtio balloon device ignored\n", regs);
+        return;
+    }
+
+    // Signal device that we found a driver
+    regs->status |= VIRTIO_STAT_DRIVER;
+    // fence o,io
+    __sync_synchronize();
+
+    // Negotiate features. We need nothing beyond version 1. We want:
+    // - VIRTIO_BALLOON_F_MUST_TELL_HOST (honored if offered),
+    // - VIRTIO_BALLOON_F_STATS_VQ and
+    // - VIRTIO_BALLOON_F_DEFLATE_ON_OOM.
+
+    virtio_featset_init(needed_features);
+    virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_BALLOON_F_MUST_TELL_HOST);
+    virtio_featset_add(wanted_features, VIRTIO_BALLOON_F_STATS_VQ);
+    virtio_featset_add(wanted_features, VIRTIO_BALLOON_F_DEFLATE_ON_OOM);
+    result = virtio_negotiate_features(regs,
+        enabled_features, wanted_features, needed_features);
+
+    if (result != 0) {
+        kprintf("%p: virtio feature negotiation failed\n", regs);
+        return;
+    }
+
+    dev = kmalloc(sizeof(struct vioballoon_device));
+    memset(dev, 0, sizeof(struct vioballoon_device));
+
+    dev->regs = regs;
+    dev->irqno = irqno;
+    dev->tell_host = virtio_featset_test(enabled_features,
+        VIRTIO_BALLOON_F_MUST_TELL_HOST);
+    dev->has_stats = virtio_featset_test(enabled_features,
+        VIRTIO_BALLOON_F_STATS_VQ);
+
+    condition_init(&dev->used_updated, "vioballoon_used_updated");
+    condition_init(&dev->work, "vioballoon_work");
+    lock_init(&dev->lock, "vioballoon");
+
+    // Attach and enable virtqueues
+
+    for (q = 0; q < (dev->has_stats ? VIOBALLOON_NQ : VIOBALLOON_STATSQ); q++) {
+        virtio_attach_virtq(regs, q, 1,
+            kva_to_pma(&dev->vq[q].desc[0]),
+            kva_to_pma(&dev->vq[q].used),
+            kva_to_pma(&dev->vq[q].avail));
+        virtio_enable_virtq(regs, q);
+    }
+
+    intr_register_isr(irqno, VIOBALLOON_IRQ_PRIO, vioballoon_isr, dev);
+
+    regs->status |= VIRTIO_STAT_DRIVER_OK;
+    // fence o,oi
+    __sync_synchronize();
+
+    // The device asks for statistics by using the buffer we give it here
+
+    if (dev->has_stats)
+        vioballoon_post_stats(dev);
+
+    balloon = dev;
+    dev->config_changed = 1;
+    intr_enable_irq(irqno);
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BALLOON_F_DEFLATE_ON_OOM))
+        memory_balloon_init(vioballoon_oom_deflate);
+
+    if (thread_spawn("vioballoon", vioballoon_thread, dev) < 0)
+        kprintf("%p: Failed to start balloon thread\n", regs);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Wakes up the driver thread when the target size changes or the device
+// has taken the statistics buffer, and the requester of an inflate or
+// deflate request when it completes.
+
+static void vioballoon_isr(int irqno, void * aux) {
+    struct vioballoon_device * const dev = aux;
+    const uint32_t isr_status = dev->regs->interrupt_status;
+    const struct vioballoon_vq * const statsq = &dev->vq[VIOBALLOON_STATSQ];
+
+    dev->regs->interrupt_ack = isr_status;
+    __sync_synchronize();
+
+    if (isr_status & VIRTIO_INT_CONFIG) {
+        dev->config_changed = 1;
+        condition_broadcast(&dev->work);
+    }
+
+    if (isr_status & VIRTIO_INT_USED) {
+        if (dev->has_stats && statsq->used.idx == statsq->avail.idx &&
+            !dev->stats_wanted)
+        {
+            dev->stats_wanted = 1;
+            condition_broadcast(&dev->work);
+        }
+
+        condition_broadcast(&dev->used_updated);
+    }
+}
+
+/**
+ * Name: vioballoon_thread
+ *
+ * Inputs:
+ *  void* -> aux, the balloon device
+ *
+ * Outputs:
+ *  void (does not return)
+ *
+ * Purpose:
+ *  Moves the balloon towards the size the host asks for each time the
+ *  target changes, and answers requests for statistics.
+ *
+ * Side effects:
+ *  Takes pages from or returns pages to the page allocator and updates the
+ *  actual balloon size in the device config space.
+ */
+static void vioballoon_thread(void * aux) {
+    struct vioballoon_device * const dev = aux;
+    size_t target;
+    int pie;
+
+    for (;;) {
+        // The flags are checked and cleared with interrupts disabled so that
+        // the ISR cannot have the stats buffer posted twice.
+
+        pie = intr_disable();
+
+        while (!dev->config_changed && !dev->stats_wanted)
+            condition_wait(&dev->work);
+
+        if (dev->stats_wanted) {
+            vioballoon_post_stats(dev);
+            dev->stats_wanted = 0;
+        }
+
+        if (!dev->config_changed) {
+            intr_restore(pie);
+            continue;
+        }
+
+        dev->config_changed = 0;
+        intr_restore(pie);
+
+        // The target is in 4 KB pages regardless of the guest page size
+
+        target = dev->regs->config.balloon.num_pages;
+
+        lock_acquire(&dev->lock);
+
+        if (dev->page_cnt < target)
+            vioballoon_inflate(dev, target - dev->page_cnt);
+        else if (target < dev->page_cnt)
+            vioballoon_deflate(dev, dev->page_cnt - target);
+
+        dev->regs->config.balloon.actual = dev->page_cnt;
+        lock_release(&dev->lock);
+
+        debug("balloon: target %zu, actual %zu pages", target, dev->page_cnt);
+    }
+}
+
+// Called by the page allocator when it runs out of memory. Returns the number
+// of pages given back, which is 0 if the balloon is empty or the call came
+// from the driver itself.
+
+static size_t vioballoon_oom_deflate(size_t cnt) {
+    struct vioballoon_device * const dev = balloon;
+    size_t freed;
+
+    if (dev->lock.tid == running_thread() || dev->page_cnt == 0)
+        return 0;
+
+    lock_acquire(&dev->lock);
+    freed = vioballoon_deflate(dev, cnt);
+    dev->regs->config.balloon.actual = dev->page_cnt;
+    lock_release(&dev->lock);
+
+    return freed;
+}
+
+// Adds up to /cnt/ free pages to the balloon, in batches of VIOBALLOON_BATCH.
+// Stops early if the page allocator has no free pages left; nothing is
+// swapped out to make room. Returns the number of pages added.
+
+static size_t vioballoon_inflate(struct vioballoon_device * dev, size_t cnt) {
+    struct vioballoon_chunk * chunk;
+    size_t done = 0;
+    size_t n, max;
+    void * pp;
+
+    while (done < cnt) {
+        chunk = dev->chunks;
+
+        if (chunk == NULL || chunk->cnt == VIOBALLOON_CHUNK_LEN) {
+            chunk = memory_alloc_page_nowait();
+            if (chunk == NULL)
+                break;
+            chunk->next = dev->chunks;
+            chunk->cnt = 0;
+            dev->chunks = chunk;
+        }
+
+        max = cnt - done;
+        if (VIOBALLOON_BATCH < max)
+            max = VIOBALLOON_BATCH;
+        if (VIOBALLOON_CHUNK_LEN - chunk->cnt < max)
+            max = VIOBALLOON_CHUNK_LEN - chunk->cnt;
+
+        for (n = 0; n < max; n++) {
+            pp = memory_alloc_page_nowait();
+            if (pp == NULL)
+                break;
+            chunk->pfns[chunk->cnt + n] =
+                kva_to_pma(pp) >> VIRTIO_BALLOON_PFN_SHIFT;
+        }
+
+        if (n == 0)
+            break;
+
+        vioballoon_send(dev, VIOBALLOON_INFLATEQ,
+            &chunk->pfns[chunk->cnt], n * sizeof(uint32_t));
+
+        chunk->cnt += n;
+        dev->page_cnt += n;
+        done += n;
+    }
+
+    // Do not keep an empty chunk around
+
+    chunk = dev->chunks;
+
+    if (chunk != NULL && chunk->cnt == 0) {
+        dev->chunks = chunk->next;
+        memory_free_page(chunk);
+    }
+
+    return done;
+}
+
+// Returns up to /cnt/ pages from the balloon to the page allocator, telling
+// the device first. Returns the number of pages freed.
+
+static size_t vioballoon_deflate(struct vioballoon_device * dev, size_t cnt) {
+    struct vioballoon_chunk * chunk;
+    size_t done = 0;
+    size_t n, k;
+
+    while (done < cnt && (chunk = dev->chunks) != NULL) {
+        n = cnt - done;
+        if (VIOBALLOON_BATCH < n)
+            n = VIOBALLOON_BATCH;
+        if (chunk->cnt < n)
+            n = chunk->cnt;
+
+        chunk->cnt -= n;
+
+        if (dev->tell_host) {
+            vioballoon_send(dev, VIOBALLOON_DEFLATEQ,
+                &chunk->pfns[chunk->cnt], n * sizeof(uint32_t));
+        }
+
+        for (k = 0; k < n; k++) {
+            memory_free_page(pma_to_kva((uintptr_t)chunk->pfns[chunk->cnt + k]
+                << VIRTIO_BALLOON_PFN_SHIFT));
+        }
+
+        // Without VIRTIO_BALLOON_F_MUST_TELL_HOST the device is told after
+        // the pages are reused, which is allowed.
+
+        if (!dev->tell_host) {
+            vioballoon_send(dev, VIOBALLOON_DEFLATEQ,
+                &chunk->pfns[chunk->cnt], n * sizeof(uint32_t));
+        }
+
+        dev->page_cnt -= n;
+        done += n;
+
+        if (chunk->cnt == 0) {
+            dev->chunks = chunk->next;
+            memory_free_page(chunk);
+        }
+    }
+
+    return done;
+}
+
+// Places the device-readable buffer /buf/ of /len/ bytes on virtqueue /qid/
+// and waits for the device to use it.
+
+static void vioballoon_send (
+    struct vioballoon_device * dev, int qid, void * buf, uint32_t len)
+{
+    struct vioballoon_vq * const vq = &dev->vq[qid];
+    int pie;
+
+    vq->desc[0].addr = kva_to_pma(buf);
+    vq->desc[0].len = len;
+    vq->desc[0].flags = 0;
+    vq->desc[0].next = 0;
+
+    vq->avail.ring[0] = 0;
+    __sync_synchronize();
+    vq->avail.idx++;
+    __sync_synchronize();
+
+    pie = intr_disable();
+    virtio_notify_avail(dev->regs, qid);
+    while (vq->used.idx != vq->avail.idx)
+        condition_wait(&dev->used_updated);
+    intr_restore(pie);
+}
+
+// Fills in current statistics and gives the stats buffer (back) to the
+// device, which keeps it until it wants an update. Does not wait.
+
+static void vioballoon_post_stats(struct vioballoon_device * dev) {
+    struct vioballoon_vq * const vq = &dev->vq[VIOBALLOON_STATSQ];
+    const uint64_t free_bytes = (uint64_t)memory_free_page_cnt() * PAGE_SIZE;
+
+    dev->stats[0].tag = VIRTIO_BALLOON_S_MEMFREE;
+    dev->stats[0].val = free_bytes;
+    dev->stats[1].tag = VIRTIO_BALLOON_S_MEMTOT;
+    dev->stats[1].val = RAM_SIZE;
+    dev->stats[2].tag = VIRTIO_BALLOON_S_AVAIL;
+    dev->stats[2].val = free_bytes;
+
+    vq->desc[0].addr = kva_to_pma(dev->stats);
+    vq->desc[0].len = sizeof(dev->stats);
+    vq->desc[0].flags = 0;
+    vq->desc[0].next = 0;
+
+    vq->avail.ring[0] = 0;
+    __sync_synchronize();
+    vq->avail.idx++;
+    __sync_synchronize();
+
+    virtio_notify_avail(dev->regs, VIOBALLOON_STATSQ);
+}
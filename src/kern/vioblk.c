@@ -11,6 +11,7 @@
 #include "string.h"
 #include "lock.h"
 #include "thread.h"
+#include "memory.h"
 
 // COMPILE-TIME PARAMETERS
 //          
@@ -239,22 +240,22 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     condition_init(&dev->vq.used_updated, "vioblk_used_updated");
 
     // Set up descriptors
-    dev->vq.desc[0].addr = (uint64_t)&dev->vq.desc[1];
+    dev->vq.desc[0].addr = kva_to_pma(&dev->vq.desc[1]);
     dev->vq.desc[0].len = sizeof(struct virtq_desc) * 3;
     dev->vq.desc[0].flags = VIRTQ_DESC_F_INDIRECT;
     dev->vq.desc[0].next = 0;
 
-    dev->vq.desc[1].addr = (uint64_t)&dev->vq.req_header;
+    dev->vq.desc[1].addr = kva_to_pma(&dev->vq.req_header);
     dev->vq.desc[1].len = sizeof(struct vioblk_request_header);
     dev->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;
     dev->vq.desc[1].next = 1;
 
-    dev->vq.desc[2].addr = (uint64_t)dev->blkbuf;
+    dev->vq.desc[2].addr = kva_to_pma(dev->blkbuf);
     dev->vq.desc[2].len = dev->blksz;
     dev->vq.desc[2].flags = VIRTQ_DESC_F_NEXT;
     dev->vq.desc[2].next = 2;
 
-    dev->vq.desc[3].addr = (uint64_t)&dev->vq.req_status;
+    dev->vq.desc[3].addr = kva_to_pma(&dev->vq.req_status);
     dev->vq.desc[3].len = sizeof(dev->vq.req_status);
     dev->vq.desc[3].flags = VIRTQ_DESC_F_WRITE;
     dev->vq.desc[3].next = 0;
@@ -268,7 +269,7 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     dev->vq.used.idx = 0;
 
     // Attach and enable virtqueue
-    virtio_attach_virtq(regs, 0, 1, (uint64_t)&dev->vq.desc[0], (uint64_t)&dev->vq.used, (uint64_t)&dev->vq.avail);
+    virtio_attach_virtq(regs, 0, 1, kva_to_pma(&dev->vq.desc[0]), kva_to_pma(&dev->vq.used), kva_to_pma(&dev->vq.avail));
     virtio_enable_virtq(regs, 0);
 
     // Register the ISR and device
@@ -357,8 +358,6 @@ void vioblk_close(struct io_intf * io) {
     dev->vq.avail.idx = 0;
     dev->vq.used.idx = 0;
 
-    kfree(dev->blkbuf);
-
     intr_disable_irq(dev->irqno);
 }
 
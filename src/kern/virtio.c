@@ -26,6 +26,10 @@ void virtio_attach(void * mmio_base, int irqno) {
         //           vioblk.c
         volatile struct virtio_mmio_regs * regs, int irqno);
 
+    extern void vioballoon_attach (
+        //           vioballoon.c
+        volatile struct virtio_mmio_regs * regs, int irqno);
+
     if (regs->magic_value != VIRTIO_MAGIC) {
         kprintf("%p: No virtio magic number found\n", mmio_base);
         return;
@@ -53,6 +57,10 @@ void virtio_attach(void * mmio_base, int irqno) {
         debug("%p: Found virtio block device", regs);
         vioblk_attach(regs, irqno);
         break;
+    case VIRTIO_ID_BALLOON:
+        debug("%p: Found virtio balloon device", regs);
+        vioballoon_attach(regs, irqno);
+        break;
     default:
         kprintf("%p: Unknown virtio device type %u ignored\n",
             mmio_base, (unsigned int) regs->device_id);
@@ -0,0 +1,147 @@
+// wss.c - Working-set sampler
+//
+
+#ifdef WSS_TRACE
+#define TRACE
+#endif
+
+#ifdef WSS_DEBUG
+#define DEBUG
+#endif
+
+#include "wss.h"
+#include "memory.h"
+#include "process.h"
+#include "device.h"
+#include "timer.h"
+#include "string.h"
+#include "console.h"
+#include "config.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Size of the text buffer a report is formatted into when the device is opened
+
+#define WSS_REPORT_MAX (64 * (NPROC + 1))
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Latest sample of one process slot. The working set estimate is an
+// exponentially weighted average of the pages accessed per interval, with a
+// weight of 1/8 for the newest interval; it is kept scaled by 8.
+
+struct wss_stat {
+    int pid; // -1 if the slot is unused
+    size_t resident;
+    size_t accessed;
+    size_t dirtied;
+    size_t wss8;
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct wss_stat wss_tab[NPROC];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void wss_thread(void * aux);
+static int wss_open(struct io_intf ** ioptr, void * aux);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void wss_init(void) {
+    int pid;
+
+    trace("%s()", __func__);
+
+    for (pid = 0; pid < NPROC; pid++)
+        wss_tab[pid].pid = -1;
+
+    if (device_register("wss", wss_open, NULL) < 0)
+        kprintf("wss: device_register failed\n");
+
+    if (thread_spawn("wss", wss_thread, NULL) < 0)
+        kprintf("wss: failed to start sampler thread\n");
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Samples every process once per WSS_SAMPLE_MS. The scan runs in a thread
+// woken by the timer rather than in the timer interrupt itself, as walking
+// the page tables of all processes is too long for an ISR.
+
+static void wss_thread(void * aux) {
+    struct memory_sample smp;
+    struct process * proc;
+    struct wss_stat * st;
+    struct alarm al;
+    int pid;
+
+    alarm_init(&al, "wss");
+
+    for (;;) {
+        alarm_sleep_ms(&al, WSS_SAMPLE_MS);
+
+        for (pid = 0; pid < NPROC; pid++) {
+            proc = proctab[pid];
+            st = &wss_tab[pid];
+
+            if (proc == NULL) {
+                st->pid = -1;
+                continue;
+            }
+
+            memory_space_sample(proc->mtag, &smp);
+
+            // A new process in the slot starts with a fresh estimate
+
+            if (st->pid != proc->id) {
+                st->pid = proc->id;
+                st->wss8 = 8 * smp.accessed;
+            } else
+                st->wss8 = st->wss8 - st->wss8 / 8 + smp.accessed;
+
+            st->resident = smp.resident;
+            st->accessed = smp.accessed;
+            st->dirtied = smp.dirtied;
+        }
+    }
+}
+
+// Opening the device takes a snapshot of the latest samples as a text report
+
+static int wss_open(struct io_intf ** ioptr, void * aux) {
+    const struct wss_stat * st;
+    struct io_buf * rpt;
+    size_t len;
+    int pid;
+
+    rpt = iobuf_alloc(WSS_REPORT_MAX);
+
+    len = snprintf(rpt->buf, WSS_REPORT_MAX,
+        "pid resident accessed dirtied wss dirty/s (pages, %d ms)\n",
+        WSS_SAMPLE_MS);
+
+    for (pid = 0; pid < NPROC; pid++) {
+        st = &wss_tab[pid];
+
+        if (st->pid < 0)
+            continue;
+
+        len += snprintf(rpt->buf + len, WSS_REPORT_MAX - len,
+            "%d %zu %zu %zu %zu %zu\n", st->pid, st->resident, st->accessed,
+            st->dirtied, st->wss8 / 8, st->dirtied * 1000 / WSS_SAMPLE_MS);
+    }
+
+    if (WSS_REPORT_MAX <= len)
+        len = WSS_REPORT_MAX - 1;
+
+    *ioptr = iobuf_init(rpt, len);
+    return 0;
+}
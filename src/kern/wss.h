@@ -0,0 +1,21 @@
+// wss.h - Working-set sampler
+//
+
+#ifndef _WSS_H_
+#define _WSS_H_
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void wss_init(void)
+// Starts a kernel thread that samples the accessed and dirty bits of every
+// process's user mappings every WSS_SAMPLE_MS milliseconds, and registers the
+// "wss" device. Reading the device returns a text report with one line per
+// process: its resident pages, the pages it accessed and dirtied in the last
+// interval, a smoothed working set size and its dirty rate in pages per
+// second. Must be called after the thread, process and device managers are
+// initialized.
+
+extern void wss_init(void);
+
+#endif // _WSS_H_
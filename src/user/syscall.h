@@ -18,5 +18,8 @@ extern int _exec(int fd);
 extern int _fork(void);
 extern int _wait(int tid);
 extern int _usleep(unsigned long us);
+extern void * _mmap(int fd, unsigned long off, size_t len);
+extern int _munmap(void * addr);
+extern int _reserve(unsigned long runtime_us, unsigned long period_us);
 
 #endif // _SYSCALL_H_